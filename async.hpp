@@ -0,0 +1,369 @@
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+// C++17 interface to the thread pool and futures. Header only: link with
+// asyncc as for the C interface.
+//
+// Closures run through trampolines instantiated for their type instead of
+// void * boxes. A task submitted with pool::submit whose closure is trivially
+// copyable and fits in the 16 bytes of arg and argsz travels inside the
+// runnable_t itself, so it costs no allocation beyond what defer does.
+// A future<T> makes a single allocation, which holds the future_t, the
+// closure when it fits in FUTURE_CLOSURE_SIZE bytes, and the result.
+//
+// C API errors are thrown as std::system_error; exceptions thrown by tasks
+// are rethrown by future::get.
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <new>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "threadpool.h"
+#include "future.h"
+}
+
+namespace asyncc {
+
+namespace detail {
+
+inline void check(int err, const char *what) {
+    if (err)
+        throw std::system_error(errno ? errno : EAGAIN, std::generic_category(), what);
+}
+
+// Closures this small and trivially copyable are passed in runnable_t
+// by value, in place of the arg pointer and argsz.
+template <class F>
+constexpr bool packable = std::is_trivially_copyable_v<F>
+                          && sizeof(F) <= sizeof(void *) + sizeof(size_t)
+                          && alignof(F) <= alignof(void *);
+
+template <class F>
+void run_packed(void *arg, size_t argsz) {
+    unsigned char bytes[sizeof(void *) + sizeof(size_t)];
+    std::memcpy(bytes, &arg, sizeof(arg));
+    std::memcpy(bytes + sizeof(arg), &argsz, sizeof(argsz));
+    alignas(F) unsigned char storage[sizeof(F)];
+    std::memcpy(storage, bytes, sizeof(F));
+    try {
+        (*std::launder(reinterpret_cast<F *>(storage)))();
+    } catch (...) {
+        // nobody to rethrow to, and it must not unwind through the pool
+        std::terminate();
+    }
+}
+
+template <class F>
+void run_boxed(void *arg, size_t) {
+    std::unique_ptr<F> f(static_cast<F *>(arg));
+    try {
+        (*f)();
+    } catch (...) {
+        std::terminate();
+    }
+}
+
+template <class F>
+runnable_t make_runnable(F &&f) {
+    using Fn = std::decay_t<F>;
+    runnable_t runnable{};
+    if constexpr (packable<Fn>) {
+        unsigned char bytes[sizeof(void *) + sizeof(size_t)] = {};
+        std::memcpy(bytes, &f, sizeof(Fn));
+        std::memcpy(&runnable.arg, bytes, sizeof(runnable.arg));
+        std::memcpy(&runnable.argsz, bytes + sizeof(runnable.arg), sizeof(runnable.argsz));
+        runnable.function = run_packed<Fn>;
+    } else {
+        runnable.arg = new Fn(std::forward<F>(f));
+        runnable.function = run_boxed<Fn>;
+    }
+    return runnable;
+}
+
+template <class F>
+void discard_runnable(const runnable_t &runnable) {
+    using Fn = std::decay_t<F>;
+    if constexpr (!packable<Fn>)
+        delete static_cast<Fn *>(runnable.arg);
+}
+
+constexpr size_t FUTURE_CLOSURE_SIZE = 48;
+
+// Shared by every future: the C future, the closure run by it and what
+// it threw.
+struct state_base {
+    future_t future;
+    alignas(std::max_align_t) unsigned char closure[FUTURE_CLOSURE_SIZE];
+    void *closure_ptr = nullptr;
+    void (*destroy_closure)(void *, bool) = nullptr;
+    std::exception_ptr error;
+    // state whose result is the argument of the closure, freed once used
+    state_base *parent = nullptr;
+    void (*free_self)(state_base *) = nullptr;
+
+    template <class F>
+    void set_closure(F &&f) {
+        using Fn = std::decay_t<F>;
+        bool inline_closure = sizeof(Fn) <= FUTURE_CLOSURE_SIZE
+                              && alignof(Fn) <= alignof(std::max_align_t);
+        if (inline_closure)
+            closure_ptr = new (closure) Fn(std::forward<F>(f));
+        else
+            closure_ptr = new Fn(std::forward<F>(f));
+        destroy_closure = [](void *p, bool heap) {
+            if (heap)
+                delete static_cast<Fn *>(p);
+            else
+                static_cast<Fn *>(p)->~Fn();
+        };
+    }
+
+    template <class Fn>
+    Fn &closure_as() { return *static_cast<Fn *>(closure_ptr); }
+
+    void drop_closure() {
+        if (destroy_closure)
+            destroy_closure(closure_ptr, closure_ptr != static_cast<void *>(closure));
+        destroy_closure = nullptr;
+    }
+
+    // A future completed before map was called on it still posts its
+    // semaphore, possibly after the continuation started; wait for that.
+    static void release(state_base *state) {
+        if (state->future.cont.exit_handler == nullptr)
+            while (sem_wait(&state->future.on_result) != 0 && errno == EINTR);
+        state->free_self(state);
+    }
+};
+
+template <class T>
+struct state : state_base {
+    std::optional<T> value;
+
+    state() { free_self = [](state_base *s) { delete static_cast<state *>(s); }; }
+    ~state() { drop_closure(); }
+
+    template <class F, class... A>
+    void compute(F &f, A &&...args) { value.emplace(f(std::forward<A>(args)...)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct state<void> : state_base {
+    state() { free_self = [](state_base *s) { delete static_cast<state *>(s); }; }
+    ~state() { drop_closure(); }
+
+    template <class F, class... A>
+    void compute(F &f, A &&...args) { f(std::forward<A>(args)...); }
+    void take() {}
+};
+
+// Results are returned as the state itself, with size 0.
+template <class T, class Fn>
+void *run_async(void *arg, size_t, size_t *retsz) {
+    auto *s = static_cast<state<T> *>(arg);
+    try {
+        s->compute(s->template closure_as<Fn>());
+    } catch (...) {
+        s->error = std::current_exception();
+    }
+    s->drop_closure();
+    *retsz = 0;
+    return s;
+}
+
+// Continuation of map: the argument is the parent state, and the state
+// being computed is the one the parent points to.
+template <class T, class U, class Fn>
+void *run_then(void *arg, size_t, size_t *retsz) {
+    auto *parent = static_cast<state<T> *>(arg);
+    auto *s = static_cast<state<U> *>(parent->parent);
+    parent->parent = nullptr;
+    if (parent->error) {
+        s->error = parent->error;
+    } else {
+        try {
+            if constexpr (std::is_void_v<T>)
+                s->compute(s->template closure_as<Fn>());
+            else
+                s->compute(s->template closure_as<Fn>(), parent->take());
+        } catch (...) {
+            s->error = std::current_exception();
+        }
+    }
+    s->drop_closure();
+    state_base::release(parent);
+    *retsz = 0;
+    return s;
+}
+
+template <class T, class F>
+struct then_result {
+    using type = std::invoke_result_t<F, T>;
+};
+
+template <class F>
+struct then_result<void, F> {
+    using type = std::invoke_result_t<F>;
+};
+
+struct deduce {};
+
+// Marks the constructor which adopts a state made by async or then.
+struct adopt {};
+
+} // namespace detail
+
+template <class T>
+class future;
+
+// A thread_pool_t, owned or borrowed from C code.
+class pool {
+  public:
+    explicit pool(size_t num_threads) : owned_(new thread_pool_t) {
+        if (thread_pool_init(owned_.get(), num_threads)) {
+            owned_.reset();
+            detail::check(ERR, "thread_pool_init");
+        }
+        pool_ = owned_.get();
+    }
+
+    // Borrows an existing pool; nullptr selects the default one.
+    explicit pool(thread_pool_t *borrowed)
+        : pool_(borrowed ? borrowed : thread_pool_default()) {}
+
+    pool(pool &&other) noexcept = default;
+    pool &operator=(pool &&other) = delete;
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    ~pool() {
+        if (owned_)
+            thread_pool_destroy(owned_.get());
+    }
+
+    thread_pool_t *native() const { return pool_; }
+
+    // Runs f() on the pool, not waiting for it. If f throws, std::terminate
+    // is called, as for a std::thread.
+    template <class F>
+    void submit(F &&f) {
+        runnable_t runnable = detail::make_runnable(std::forward<F>(f));
+        if (defer(pool_, runnable)) {
+            detail::discard_runnable<F>(runnable);
+            detail::check(ERR, "defer");
+        }
+    }
+
+  private:
+    std::unique_ptr<thread_pool_t> owned_;
+    thread_pool_t *pool_;
+};
+
+// Result of a computation on a pool. Movable, not copyable; destroying a
+// future which was not read waits for the computation.
+template <class T>
+class future {
+  public:
+    future() = default;
+    future(future &&other) noexcept
+        : state_(std::exchange(other.state_, nullptr)), pool_(other.pool_) {}
+    future &operator=(future &&other) noexcept {
+        if (this != &other) {
+            reset();
+            state_ = std::exchange(other.state_, nullptr);
+            pool_ = other.pool_;
+        }
+        return *this;
+    }
+    future(const future &) = delete;
+    future &operator=(const future &) = delete;
+    ~future() { reset(); }
+
+    bool valid() const { return state_ != nullptr; }
+
+    // Waits for the result and takes it; the future is empty afterwards.
+    T get() {
+        check_valid();
+        std::unique_ptr<detail::state<T>> s(std::exchange(state_, nullptr));
+        await(&s->future);
+        if (s->error)
+            std::rethrow_exception(s->error);
+        return s->take();
+    }
+
+    // Future of f applied to the result, computed on the same pool (or the
+    // given one) by map. Consumes this future.
+    template <class F>
+    auto then(F &&f) { return then(pool_, std::forward<F>(f)); }
+
+    template <class F>
+    auto then(thread_pool_t *pool, F &&f) {
+        check_valid();
+        using U = typename detail::then_result<T, std::decay_t<F>>::type;
+        auto child = std::make_unique<detail::state<U>>();
+        child->set_closure(std::forward<F>(f));
+        state_->parent = child.get();
+        if (map(pool, &child->future, &state_->future,
+                detail::run_then<T, U, std::decay_t<F>>)) {
+            state_->parent = nullptr;
+            detail::check(ERR, "map");
+        }
+        // from now on the parent state belongs to the continuation
+        state_ = nullptr;
+        return future<U>(detail::adopt{}, child.release(), pool);
+    }
+
+    future(detail::adopt, detail::state<T> *s, thread_pool_t *pool)
+        : state_(s), pool_(pool) {}
+
+  private:
+    void check_valid() const {
+        if (!valid())
+            throw std::future_error(std::future_errc::no_state);
+    }
+
+    void reset() {
+        if (state_)
+            get_ignoring_errors();
+    }
+
+    void get_ignoring_errors() {
+        std::unique_ptr<detail::state<T>> s(std::exchange(state_, nullptr));
+        await(&s->future);
+    }
+
+    detail::state<T> *state_ = nullptr;
+    thread_pool_t *pool_ = nullptr;
+};
+
+// Runs f() on the pool (nullptr: the default one) with async. The result
+// type is deduced unless given as R.
+template <class R = detail::deduce, class F>
+auto async(thread_pool_t *pool, F &&f) {
+    using T = std::conditional_t<std::is_same_v<R, detail::deduce>,
+                                 std::invoke_result_t<std::decay_t<F>>, R>;
+    auto s = std::make_unique<detail::state<T>>();
+    s->set_closure(std::forward<F>(f));
+    callable_t callable{detail::run_async<T, std::decay_t<F>>, s.get(), 0};
+    detail::check(::async(pool, &s->future, callable), "async");
+    return future<T>(detail::adopt{}, s.release(), pool);
+}
+
+template <class R = detail::deduce, class F>
+auto async(pool &p, F &&f) {
+    return async<R>(p.native(), std::forward<F>(f));
+}
+
+} // namespace asyncc
+
+#endif
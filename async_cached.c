@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static int calls;
+
+static void *slow_squared(void *arg, size_t argsz __attribute__((unused)),
+                          size_t *retsz) {
+  __atomic_add_fetch(&calls, 1, __ATOMIC_SEQ_CST);
+  usleep(10000);
+  int n = *(int *)arg;
+  int *ret = malloc(sizeof(int));
+  *ret = n * n;
+  *retsz = sizeof(int);
+  return ret;
+}
+
+static char *test_same_call_shared() {
+  thread_pool_t pool;
+  async_cache_t cache;
+  thread_pool_init(&pool, 4);
+  mu_assert("init failed", async_cache_init(&cache, 4, 1 << 20) == 0);
+  calls = 0;
+
+  cached_future_t *futures[8];
+  for (int i = 0; i < 8; ++i) {
+    int n = 7;
+    async_cached(&cache, &pool, &futures[i],
+                 (callable_t){.function = slow_squared, .arg = &n, .argsz = sizeof(n)});
+  }
+  for (int i = 0; i < 8; ++i) {
+    int *m = await_cached(futures[i]);
+    mu_assert("expected 49", *m == 49);
+    cached_future_release(futures[i]);
+  }
+  mu_assert("computed more than once", calls == 1);
+
+  int n = 8;
+  cached_future_t *other;
+  async_cached(&cache, &pool, &other,
+               (callable_t){.function = slow_squared, .arg = &n, .argsz = sizeof(n)});
+  mu_assert("expected 64", *(int *)await_cached(other) == 64);
+  cached_future_release(other);
+  mu_assert("different argument not computed", calls == 2);
+
+  async_cache_destroy(&cache);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_eviction() {
+  thread_pool_t pool;
+  async_cache_t cache;
+  thread_pool_init(&pool, 2);
+  // room for a single entry
+  mu_assert("init failed",
+            async_cache_init(&cache, 1, sizeof(cached_future_t) + 2 * sizeof(int)) == 0);
+  calls = 0;
+
+  for (int round = 0; round < 2; ++round) {
+    for (int n = 0; n < 4; ++n) {
+      cached_future_t *future;
+      async_cached(&cache, &pool, &future,
+                   (callable_t){.function = slow_squared, .arg = &n, .argsz = sizeof(n)});
+      mu_assert("wrong result", *(int *)await_cached(future) == n * n);
+      cached_future_release(future);
+    }
+  }
+  mu_assert("evicted results not recomputed", calls == 8);
+
+  async_cache_destroy(&cache);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_same_call_shared);
+  mu_run_test(test_eviction);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
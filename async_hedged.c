@@ -0,0 +1,198 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hedge.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static int calls;
+static int cancel_seen;
+
+static unsigned long long now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000ull + t.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec t = {ms / 1000, ms % 1000 * 1000000};
+  nanosleep(&t, NULL);
+}
+
+// The first call takes times[0] ms unless it learns it lost, later calls
+// times[1] ms. Returns the index of the call; times[2] marks a used argument.
+static void *stall_first(void *arg, size_t argsz __attribute__((unused)),
+                         size_t *retsz) {
+  long *times = arg;
+  int call = __atomic_fetch_add(&calls, 1, __ATOMIC_SEQ_CST);
+  long ms = call == 0 ? times[0] : times[1];
+  // copies must not see what the other one wrote
+  if (times[2] != 0)
+    return NULL;
+  times[2] = call + 1;
+  for (long i = 0; i < ms; ++i) {
+    if (async_hedged_cancelled()) {
+      __atomic_store_n(&cancel_seen, 1, __ATOMIC_SEQ_CST);
+      return NULL;
+    }
+    sleep_ms(1);
+  }
+  int *result = malloc(sizeof(int));
+  *result = call;
+  *retsz = sizeof(int);
+  return result;
+}
+
+static char *test_second_copy_wins() {
+  thread_pool_t pool;
+  future_t future;
+  thread_pool_init(&pool, 2);
+  calls = 0;
+  cancel_seen = 0;
+
+  long times[3] = {2000, 1, 0};
+  callable_t callable = {.function = stall_first, .arg = times, .argsz = sizeof(times)};
+  unsigned long long start = now_ms();
+  mu_assert("async_hedged failed",
+            async_hedged(&pool, &future, callable, 20 * 1000000ull) == 0);
+  int *result = await(&future);
+  mu_assert("stalled copy waited for", now_ms() - start < 1000);
+  mu_assert("copies shared the argument", result != NULL);
+  mu_assert("first copy won", *result == 1);
+  mu_assert("caller's argument modified", times[2] == 0);
+  free(result);
+
+  // the loser finishes before the pool is gone
+  thread_pool_destroy(&pool);
+  mu_assert("loser not cancelled", cancel_seen);
+  return 0;
+}
+
+static char *test_fast_call_not_hedged() {
+  thread_pool_t pool;
+  future_t future;
+  thread_pool_init(&pool, 2);
+  calls = 0;
+
+  long times[3] = {1, 1, 0};
+  callable_t callable = {.function = stall_first, .arg = times, .argsz = sizeof(times)};
+  async_hedged(&pool, &future, callable, 500 * 1000000ull);
+  int *result = await(&future);
+  mu_assert("wrong result", result != NULL && *result == 0);
+  free(result);
+  sleep_ms(600);
+  mu_assert("hedged a fast call", calls == 1);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void *take_ms(void *arg, size_t argsz __attribute__((unused)),
+                     size_t *retsz __attribute__((unused))) {
+  long *times = arg;
+  int call = __atomic_fetch_add(&calls, 1, __ATOMIC_SEQ_CST);
+  long ms = call == 0 ? times[0] : times[1];
+  for (long i = 0; i < ms && !async_hedged_cancelled(); ++i)
+    sleep_ms(1);
+  return NULL;
+}
+
+static char *test_threshold_from_history() {
+  thread_pool_t pool;
+  future_t future;
+  thread_pool_init(&pool, 2);
+
+  // without history a call is never hedged
+  calls = 0;
+  long slow[2] = {50, 50};
+  async_hedged(&pool, &future, (callable_t){take_ms, slow, sizeof(slow)}, 0);
+  await(&future);
+  mu_assert("hedged without history", calls == 1);
+
+  // first copies count in the history even with a fixed threshold
+  long quick[2] = {2, 2};
+  for (int i = 0; i < 40; ++i) {
+    async_hedged(&pool, &future, (callable_t){take_ms, quick, sizeof(quick)},
+                 1000 * 1000000ull);
+    await(&future);
+  }
+
+  __atomic_store_n(&calls, 0, __ATOMIC_SEQ_CST);
+  long stalled[2] = {2000, 2};
+  unsigned long long start = now_ms();
+  async_hedged(&pool, &future, (callable_t){take_ms, stalled, sizeof(stalled)}, 0);
+  await(&future);
+  mu_assert("not hedged after the 95th percentile", now_ms() - start < 1000);
+
+  thread_pool_destroy(&pool);
+  mu_assert("no second copy", calls == 2);
+  return 0;
+}
+
+static int misaligned;
+
+static void *check_alignment(void *arg, size_t argsz __attribute__((unused)),
+                             size_t *retsz __attribute__((unused))) {
+  if ((uintptr_t)arg % _Alignof(max_align_t))
+    __atomic_store_n(&misaligned, 1, __ATOMIC_SEQ_CST);
+  sleep_ms(20);
+  return NULL;
+}
+
+static char *test_copies_aligned() {
+  thread_pool_t pool;
+  future_t future;
+  char odd[3] = {0};
+  thread_pool_init(&pool, 2);
+  misaligned = 0;
+  callable_t callable = {.function = check_alignment, .arg = odd, .argsz = sizeof(odd)};
+  async_hedged(&pool, &future, callable, 1000000ull);
+  await(&future);
+  thread_pool_destroy(&pool);
+  mu_assert("argument copy misaligned", !misaligned);
+  return 0;
+}
+
+static void *quick(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                   size_t *retsz __attribute__((unused))) {
+  return NULL;
+}
+
+// The timer fires about when the first copy finishes, and the pool is gone
+// right after that; the timer must not be deferring to it then.
+static char *test_pool_destroyed_after_result() {
+  for (int i = 0; i < 200; ++i) {
+    thread_pool_t pool;
+    future_t future;
+    thread_pool_init(&pool, 1);
+    async_hedged(&pool, &future, (callable_t){.function = quick}, 1000ull * (i % 50));
+    await(&future);
+    thread_pool_destroy(&pool);
+  }
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_second_copy_wins);
+  mu_run_test(test_fast_call_not_hedged);
+  mu_run_test(test_threshold_from_history);
+  mu_run_test(test_copies_aligned);
+  mu_run_test(test_pool_destroyed_after_result);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
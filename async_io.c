@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static void *bytes_doubled(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz) {
+  ssize_t n = *(ssize_t *)arg * 2;
+  return future_return(&n, sizeof(n), retsz);
+}
+
+static char *test_pipe_read_then_map() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  int fds[2];
+  mu_assert("pipe failed", pipe(fds) == 0);
+
+  char buf[16] = {};
+  future_t received, doubled;
+  mu_assert("async_read failed", async_read(&pool, &received, fds[0], buf, sizeof(buf)) == 0);
+  mu_assert("map failed", map(&pool, &doubled, &received, bytes_doubled) == 0);
+  usleep(10000);
+  mu_assert("write failed", write(fds[1], "hello", 5) == 5);
+  mu_assert("expected 10", *(ssize_t *)await(&doubled) == 10);
+  mu_assert("wrong data", memcmp(buf, "hello", 5) == 0);
+
+  future_t written;
+  mu_assert("async_write failed", async_write(&pool, &written, fds[1], "abc", 3) == 0);
+  mu_assert("expected 3 written", *(ssize_t *)await(&written) == 3);
+  mu_assert("wrong data written", read(fds[0], buf, sizeof(buf)) == 3 && memcmp(buf, "abc", 3) == 0);
+
+  close(fds[0]);
+  close(fds[1]);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_eventfd_poll() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  int efd = eventfd(0, EFD_NONBLOCK);
+  mu_assert("eventfd failed", efd >= 0);
+
+  future_t polls[3];
+  for (int i = 0; i < 3; ++i)
+    mu_assert("async_poll failed", async_poll(&pool, &polls[i], efd, POLLIN) == 0);
+  uint64_t one = 1;
+  mu_assert("write failed", write(efd, &one, sizeof(one)) == sizeof(one));
+  for (int i = 0; i < 3; ++i)
+    mu_assert("POLLIN expected", *(int *)await(&polls[i]) & POLLIN);
+
+  close(efd);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_regular_file() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  FILE *file = tmpfile();
+  mu_assert("tmpfile failed", file != NULL);
+  int fd = fileno(file);
+
+  future_t written;
+  mu_assert("async_write failed", async_write(&pool, &written, fd, "0123456789", 10) == 0);
+  mu_assert("expected 10 written", *(ssize_t *)await(&written) == 10);
+  lseek(fd, 2, SEEK_SET);
+  char buf[16] = {};
+  future_t received;
+  mu_assert("async_read failed", async_read(&pool, &received, fd, buf, 4) == 0);
+  mu_assert("expected 4 read", *(ssize_t *)await(&received) == 4);
+  mu_assert("wrong data", memcmp(buf, "2345", 4) == 0);
+
+  fclose(file);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_cancelled_on_destroy() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  int fds[2];
+  mu_assert("pipe failed", pipe(fds) == 0);
+
+  char buf[4];
+  future_t received;
+  mu_assert("async_read failed", async_read(&pool, &received, fds[0], buf, sizeof(buf)) == 0);
+  thread_pool_destroy(&pool);
+  mu_assert("expected -ECANCELED", *(ssize_t *)await(&received) == -ECANCELED);
+
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_pipe_read_then_map);
+  mu_run_test(test_eventfd_poll);
+  mu_run_test(test_regular_file);
+  mu_run_test(test_cancelled_on_destroy);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
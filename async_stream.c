@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define CAPACITY 4
+#define VALUES 1000
+
+static async_stream_t stream;
+static sem_t first_seen;
+
+// Pushes 0..VALUES-1, but only after the consumer got the first value, which
+// it can only do while the stream is still open.
+static void produce(void *arg __attribute__((unused)),
+                    size_t argsz __attribute__((unused))) {
+  static int values[VALUES];
+  for (int i = 0; i < VALUES; ++i) {
+    values[i] = i;
+    async_stream_push(&stream, &values[i], sizeof(int));
+    if (i == 0)
+      while (sem_wait(&first_seen) != 0);
+  }
+  async_stream_close(&stream);
+}
+
+static char *test_pull_in_batches() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  sem_init(&first_seen, 0, 0);
+  async_stream_init(&stream, &pool, CAPACITY);
+  defer(&pool, (runnable_t){.function = produce});
+
+  struct async_stream_item batch[3];
+  int expected = 0;
+  size_t taken;
+  while ((taken = async_stream_pull(&stream, batch, 3)) > 0) {
+    mu_assert("batch larger than the buffer", taken <= CAPACITY);
+    for (size_t i = 0; i < taken; ++i) {
+      mu_assert("values out of order", *(int *)batch[i].value == expected);
+      mu_assert("wrong size", batch[i].size == sizeof(int));
+      expected++;
+    }
+    if (expected == 1)
+      sem_post(&first_seen);
+  }
+  mu_assert("values lost", expected == VALUES);
+  mu_assert("push after close accepted", async_stream_push(&stream, NULL, 0) != 0);
+
+  async_stream_wait(&stream);
+  async_stream_destroy(&stream);
+  sem_destroy(&first_seen);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static int sum;
+static int running, max_running;
+
+static void add_value(void *value, size_t size __attribute__((unused)),
+                      void *context) {
+  int now = __atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+  int max = __atomic_load_n(&max_running, __ATOMIC_SEQ_CST);
+  while (now > max && !__atomic_compare_exchange_n(&max_running, &max, now, 0,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  if (*(int *)value == 0)
+    sem_post(context);
+  usleep(100);
+  __atomic_add_fetch(&sum, *(int *)value, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+}
+
+static char *test_for_each() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 8);
+  sem_init(&first_seen, 0, 0);
+  async_stream_init(&stream, &pool, CAPACITY);
+  sum = running = max_running = 0;
+  defer(&pool, (runnable_t){.function = produce});
+  usleep(10000);
+  mu_assert("for_each failed", async_stream_for_each(&stream, add_value, &first_seen) == 0);
+
+  async_stream_wait(&stream);
+  mu_assert("wrong sum", sum == VALUES * (VALUES - 1) / 2);
+  mu_assert("more continuations than capacity", max_running <= CAPACITY);
+
+  async_stream_destroy(&stream);
+  sem_destroy(&first_seen);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_pull_in_batches);
+  mu_run_test(test_for_each);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -17,6 +17,13 @@ static void *squared(void *arg, size_t argsz __attribute__((unused)),
   return ret;
 }
 
+static void *squared_inline(void *arg, size_t argsz __attribute__((unused)),
+                            size_t *retsz) {
+  int n = *(int *)arg;
+  int ret = n * n;
+  return future_return(&ret, sizeof(ret), retsz);
+}
+
 static char *test_await_simple() {
   thread_pool_init(&pool, 2);
 
@@ -33,8 +40,53 @@ static char *test_await_simple() {
   return 0;
 }
 
+static char *test_await_inline_result() {
+  thread_pool_init(&pool, 2);
+
+  int n = 16;
+  async(&pool, &future,
+        (callable_t){.function = squared_inline, .arg = &n, .argsz = sizeof(int)});
+  int *m = await(&future);
+
+  mu_assert("expected 256", *m == 256);
+  mu_assert("result not stored in the future", (void *)m == future.inline_result);
+  mu_assert("wrong result size", future.result_size == sizeof(int));
+  future_result_free(&future, m);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void *halve(void *arg, size_t argsz __attribute__((unused)),
+                   size_t *retsz) {
+  int n = *(int *)arg / 2;
+  return future_return(&n, sizeof(n), retsz);
+}
+
+static int below_ten(void *result, size_t size __attribute__((unused))) {
+  return *(int *)result < 10;
+}
+
+static char *test_await_iterate_until() {
+  thread_pool_init(&pool, 2);
+
+  int n = 1000;
+  async_iterate_until(&pool, &future,
+                      (callable_t){.function = halve, .arg = &n, .argsz = sizeof(int)},
+                      below_ten);
+  int *m = await(&future);
+
+  mu_assert("expected 7", *m == 7);
+  future_result_free(&future, m);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
 static char *all_tests() {
   mu_run_test(test_await_simple);
+  mu_run_test(test_await_inline_result);
+  mu_run_test(test_await_iterate_until);
   return 0;
 }
 
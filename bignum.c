@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bignum.h"
+#include "threadpool.h"
+
+#define KARATSUBA_THRESHOLD (48)
+// from this length of the shorter operand on, multiplication goes through
+// number theoretic transforms
+#define NTT_THRESHOLD (4096)
+// transforms are done modulo three primes p = c * 2^k + 1 with k >= 23
+#define NTT_MAX_LENGTH ((size_t)1 << 23)
+#define RANGE_PRODUCT_LEAF (64)
+
+int bignum_init(bignum_t *x, uint32_t value) {
+    x->capacity = 4;
+    if ((x->limb = malloc(x->capacity * sizeof(*x->limb))) == NULL)
+        return ERR;
+    x->limb[0] = value % BIGNUM_BASE;
+    x->limb[1] = value / BIGNUM_BASE;
+    x->size = x->limb[1] ? 2 : 1;
+    return OK;
+}
+
+void bignum_destroy(bignum_t *x) {
+    free(x->limb);
+    x->limb = NULL;
+    x->size = x->capacity = 0;
+}
+
+size_t limbs_normalized_size(const uint32_t *a, size_t n) {
+    while (n > 1 && a[n - 1] == 0)
+        n--;
+    return n;
+}
+
+int bignum_mul_small(bignum_t *x, uint32_t m) {
+    if (x->size + 2 > x->capacity) {
+        size_t capacity = 2 * x->capacity + 2;
+        uint32_t *limb = realloc(x->limb, capacity * sizeof(*limb));
+        if (limb == NULL)
+            return ERR;
+        x->limb = limb;
+        x->capacity = capacity;
+    }
+    uint64_t carry = 0;
+    for (size_t i = 0; i < x->size; ++i) {
+        uint64_t t = (uint64_t)x->limb[i] * m + carry;
+        x->limb[i] = t % BIGNUM_BASE;
+        carry = t / BIGNUM_BASE;
+    }
+    while (carry) {
+        x->limb[x->size++] = carry % BIGNUM_BASE;
+        carry /= BIGNUM_BASE;
+    }
+    x->size = limbs_normalized_size(x->limb, x->size);
+    return OK;
+}
+
+void limbs_add(uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    if (na < nb) {
+        const uint32_t *t = a; a = b; b = t;
+        size_t tn = na; na = nb; nb = tn;
+    }
+    uint32_t carry = 0;
+    for (size_t i = 0; i < na; ++i) {
+        uint32_t s = a[i] + (i < nb ? b[i] : 0) + carry;
+        carry = s >= BIGNUM_BASE;
+        r[i] = carry ? s - BIGNUM_BASE : s;
+    }
+    r[na] = carry;
+}
+
+uint32_t limbs_add_to(uint32_t *r, size_t nr, const uint32_t *a, size_t na) {
+    uint32_t carry = 0;
+    size_t i;
+    for (i = 0; i < na; ++i) {
+        uint32_t s = r[i] + a[i] + carry;
+        carry = s >= BIGNUM_BASE;
+        r[i] = carry ? s - BIGNUM_BASE : s;
+    }
+    for (; carry && i < nr; ++i) {
+        uint32_t s = r[i] + 1;
+        carry = s == BIGNUM_BASE;
+        r[i] = carry ? 0 : s;
+    }
+    return carry;
+}
+
+void limbs_sub_from(uint32_t *r, size_t nr, const uint32_t *a, size_t na) {
+    uint32_t borrow = 0;
+    size_t i;
+    for (i = 0; i < na; ++i) {
+        uint32_t sub = a[i] + borrow;
+        borrow = r[i] < sub;
+        r[i] = borrow ? r[i] + BIGNUM_BASE - sub : r[i] - sub;
+    }
+    for (; borrow && i < nr; ++i) {
+        borrow = r[i] == 0;
+        r[i] = borrow ? BIGNUM_BASE - 1 : r[i] - 1;
+    }
+}
+
+// Column by column: products of limbs are below 10^18, so 16 of them can be
+// summed in 64 bits before splitting the sum into limb and carry.
+// Requires nb < KARATSUBA_THRESHOLD.
+static void mul_basecase(uint32_t *r, const uint32_t *a, size_t na,
+                         const uint32_t *b, size_t nb) {
+    uint32_t rb[KARATSUBA_THRESHOLD];
+    for (size_t j = 0; j < nb; ++j)
+        rb[j] = b[nb - 1 - j];
+
+    uint64_t carry = 0;
+    for (size_t k = 0; k + 1 < na + nb; ++k) {
+        // a[i] * b[k - i] for i in [lo, hi), that is a[i] * rb[nb - 1 - k + i]
+        size_t lo = k + 1 > nb ? k + 1 - nb : 0;
+        size_t hi = k + 1 < na ? k + 1 : na;
+        const uint32_t *x = a + lo, *y = rb + (nb - 1 - k + lo);
+        size_t len = hi - lo, i = 0;
+        uint64_t low = carry % BIGNUM_BASE, high = carry / BIGNUM_BASE;
+        for (; i + 16 <= len; i += 16) {
+            uint64_t sum = 0;
+#ifdef __SSE2__
+            __m128i acc = _mm_setzero_si128();
+            for (size_t t = 0; t < 16; t += 4) {
+                __m128i xs = _mm_loadu_si128((const __m128i *)(x + i + t));
+                __m128i ys = _mm_loadu_si128((const __m128i *)(y + i + t));
+                acc = _mm_add_epi64(acc, _mm_mul_epu32(xs, ys));
+                acc = _mm_add_epi64(acc, _mm_mul_epu32(_mm_srli_epi64(xs, 32),
+                                                       _mm_srli_epi64(ys, 32)));
+            }
+            uint64_t lanes[2];
+            _mm_storeu_si128((__m128i *)lanes, acc);
+            sum = lanes[0] + lanes[1];
+#else
+            for (size_t t = 0; t < 16; ++t)
+                sum += (uint64_t)x[i + t] * y[i + t];
+#endif
+            low += sum % BIGNUM_BASE;
+            high += sum / BIGNUM_BASE;
+        }
+        uint64_t sum = 0;
+        for (; i < len; ++i)
+            sum += (uint64_t)x[i] * y[i];
+        low += sum % BIGNUM_BASE;
+        high += sum / BIGNUM_BASE;
+        r[k] = low % BIGNUM_BASE;
+        carry = high + low / BIGNUM_BASE;
+    }
+    r[na + nb - 1] = carry;
+}
+
+static size_t karatsuba_scratch(size_t n) {
+    size_t size = 0;
+    while (n >= KARATSUBA_THRESHOLD) {
+        size_t h = n - n / 2;
+        size += 4 * h + 4;
+        n = h + 1;
+    }
+    return size;
+}
+
+// r[0 .. 2n) = a[0 .. n) * b[0 .. n), ws holds karatsuba_scratch(n) limbs
+static void karatsuba(uint32_t *r, const uint32_t *a, const uint32_t *b, size_t n,
+                      uint32_t *ws) {
+    if (n < KARATSUBA_THRESHOLD) {
+        mul_basecase(r, a, n, b, n);
+        return;
+    }
+    size_t m = n / 2, h = n - m;
+    uint32_t *sa = ws, *sb = ws + h + 1, *z1 = ws + 2 * h + 2;
+
+    karatsuba(r, a, b, m, ws);
+    karatsuba(r + 2 * m, a + m, b + m, h, ws);
+    limbs_add(sa, a, m, a + m, h);
+    limbs_add(sb, b, m, b + m, h);
+    karatsuba(z1, sa, sb, h + 1, ws + 4 * h + 4);
+    limbs_sub_from(z1, 2 * h + 2, r, 2 * m);
+    limbs_sub_from(z1, 2 * h + 2, r + 2 * m, 2 * h);
+    limbs_add_to(r + m, 2 * n - m, z1, limbs_normalized_size(z1, 2 * h + 2));
+}
+
+// Arithmetic modulo a prime below 2^30 on values in Montgomery form, x * 2^32.
+typedef struct ntt_prime {
+    uint32_t p;
+    // -p^-1 mod 2^32
+    uint32_t p_neg_inv;
+    // 2^64 mod p, to convert into Montgomery form
+    uint32_t r2;
+    uint32_t generator;
+} ntt_prime_t;
+
+static uint32_t mont_reduce(const ntt_prime_t *q, uint64_t t) {
+    uint32_t m = (uint32_t)t * q->p_neg_inv;
+    uint32_t u = (t + (uint64_t)m * q->p) >> 32;
+    return u >= q->p ? u - q->p : u;
+}
+
+static uint32_t mont_mul(const ntt_prime_t *q, uint32_t a, uint32_t b) {
+    return mont_reduce(q, (uint64_t)a * b);
+}
+
+static uint32_t mont_from(const ntt_prime_t *q, uint32_t x) {
+    return mont_reduce(q, (uint64_t)x * q->r2);
+}
+
+static uint32_t mont_pow(const ntt_prime_t *q, uint32_t base, uint64_t e) {
+    uint32_t r = mont_from(q, 1);
+    for (; e; e >>= 1, base = mont_mul(q, base, base))
+        if (e & 1)
+            r = mont_mul(q, r, base);
+    return r;
+}
+
+static ntt_prime_t ntt_prime(uint32_t p, uint32_t generator) {
+    // Newton's iteration doubles the correct low bits of the inverse
+    uint32_t inv = p;
+    for (int i = 0; i < 5; ++i)
+        inv *= 2 - p * inv;
+    uint64_t r = (UINT64_MAX % p + 1) % p;
+    return (ntt_prime_t){.p = p, .p_neg_inv = -inv, .r2 = r, .generator = generator};
+}
+
+// In place transform of n (a power of two) values in Montgomery form, in
+// bit reversed order on output for the forward transform and on input for
+// the inverse one, which is not scaled by 1/n. roots holds n / 2 values.
+static void ntt(const ntt_prime_t *q, uint32_t *a, size_t n, int inverse, uint32_t *roots) {
+    uint32_t p = q->p;
+    for (size_t len = inverse ? 2 : n; inverse ? len <= n : len >= 2;
+         len = inverse ? len * 2 : len / 2) {
+        size_t half = len / 2;
+        uint32_t w = mont_pow(q, mont_from(q, q->generator), (p - 1) / len);
+        if (inverse)
+            w = mont_pow(q, w, len - 1);
+        roots[0] = mont_from(q, 1);
+        for (size_t j = 1; j < half; ++j)
+            roots[j] = mont_mul(q, roots[j - 1], w);
+        for (size_t i = 0; i < n; i += len) {
+            uint32_t *x = a + i, *y = a + i + half;
+            for (size_t j = 0; j < half; ++j) {
+                uint32_t u = x[j], v = y[j];
+                if (inverse) {
+                    // decimation in time undoes the decimation in frequency
+                    v = mont_mul(q, v, roots[j]);
+                    x[j] = u + v >= p ? u + v - p : u + v;
+                    y[j] = u >= v ? u - v : u + p - v;
+                } else {
+                    x[j] = u + v >= p ? u + v - p : u + v;
+                    y[j] = mont_mul(q, u >= v ? u - v : u + p - v, roots[j]);
+                }
+            }
+        }
+    }
+}
+
+// r[0 .. na+nb) = a * b by convolution modulo three primes, whose product
+// exceeds nb * (BIGNUM_BASE - 1)^2 for any operands of up to NTT_MAX_LENGTH
+// limbs, and the Chinese remainder theorem.
+static int ntt_mul(uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    const ntt_prime_t primes[3] = {ntt_prime(998244353, 3), ntt_prime(167772161, 3),
+                                   ntt_prime(469762049, 3)};
+    size_t n = 1;
+    while (n < na + nb)
+        n *= 2;
+    uint32_t *residues = malloc(3 * n * sizeof(*residues));
+    uint32_t *fb = malloc(n * sizeof(*fb));
+    uint32_t *roots = malloc(n / 2 * sizeof(*roots));
+    if (residues == NULL || fb == NULL || roots == NULL) {
+        free(residues);
+        free(fb);
+        free(roots);
+        return ERR;
+    }
+
+    for (int k = 0; k < 3; ++k) {
+        const ntt_prime_t *q = &primes[k];
+        uint32_t *fa = residues + k * n;
+        for (size_t i = 0; i < n; ++i) {
+            fa[i] = i < na ? mont_from(q, a[i]) : 0;
+            fb[i] = i < nb ? mont_from(q, b[i]) : 0;
+        }
+        ntt(q, fa, n, 0, roots);
+        ntt(q, fb, n, 0, roots);
+        // 1/n, as n divides p - 1
+        uint32_t scale = mont_from(q, q->p - (q->p - 1) / n);
+        for (size_t i = 0; i < n; ++i)
+            fa[i] = mont_mul(q, mont_mul(q, fa[i], fb[i]), scale);
+        ntt(q, fa, n, 1, roots);
+        for (size_t i = 0; i < n; ++i)
+            fa[i] = mont_reduce(q, fa[i]);
+    }
+
+    // Garner's algorithm. The inverses are not in Montgomery form, so that
+    // products with them are not either.
+    const ntt_prime_t *q1 = &primes[1], *q2 = &primes[2];
+    uint32_t p0 = primes[0].p, p1 = q1->p, p2 = q2->p;
+    uint32_t inv01 = mont_reduce(q1, mont_pow(q1, mont_from(q1, p0), p1 - 2));
+    uint32_t inv02 = mont_reduce(q2, mont_pow(q2, mont_from(q2, p0), p2 - 2));
+    uint32_t inv12 = mont_reduce(q2, mont_pow(q2, mont_from(q2, p1), p2 - 2));
+    unsigned __int128 carry = 0;
+    for (size_t i = 0; i < na + nb; ++i) {
+        uint32_t x0 = residues[i], r1 = residues[n + i], r2 = residues[2 * n + i];
+        uint32_t x1 = mont_mul(q1, mont_from(q1, r1 + p1 - x0 % p1), inv01);
+        uint32_t t = mont_mul(q2, mont_from(q2, r2 + p2 - x0 % p2), inv02);
+        uint32_t x2 = mont_mul(q2, mont_from(q2, t + p2 - x1 % p2), inv12);
+        carry += x0 + (uint64_t)x1 * p0 + (unsigned __int128)x2 * ((uint64_t)p0 * p1);
+        r[i] = carry % BIGNUM_BASE;
+        carry /= BIGNUM_BASE;
+    }
+
+    free(residues);
+    free(fb);
+    free(roots);
+    return OK;
+}
+
+int limbs_mul(uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    if (na < nb) {
+        const uint32_t *t = a; a = b; b = t;
+        size_t tn = na; na = nb; nb = tn;
+    }
+    if (nb < KARATSUBA_THRESHOLD) {
+        mul_basecase(r, a, na, b, nb);
+        return OK;
+    }
+    if (nb >= NTT_THRESHOLD && na + nb <= NTT_MAX_LENGTH)
+        return ntt_mul(r, a, na, b, nb);
+
+    // the longer operand is cut into pieces as long as the shorter one
+    int err = ERR;
+    uint32_t *ws = malloc(karatsuba_scratch(nb) * sizeof(*ws));
+    uint32_t *piece = malloc(2 * nb * sizeof(*piece));
+    if (ws == NULL || piece == NULL)
+        goto FREE;
+    memset(r, 0, (na + nb) * sizeof(*r));
+    for (size_t offset = 0; offset < na; offset += nb) {
+        size_t len = na - offset < nb ? na - offset : nb;
+        if (len == nb)
+            karatsuba(piece, a + offset, b, nb, ws);
+        else if (limbs_mul(piece, b, nb, a + offset, len))
+            goto FREE;
+        limbs_add_to(r + offset, na + nb - offset, piece, len + nb);
+    }
+    err = OK;
+
+FREE:
+    free(ws);
+    free(piece);
+    return err;
+}
+
+int bignum_mul(bignum_t *product, const bignum_t *a, const bignum_t *b) {
+    size_t size = a->size + b->size;
+    uint32_t *limb = malloc(size * sizeof(*limb));
+    if (limb == NULL)
+        return ERR;
+    if (limbs_mul(limb, a->limb, a->size, b->limb, b->size)) {
+        free(limb);
+        return ERR;
+    }
+    product->limb = limb;
+    product->capacity = size;
+    product->size = limbs_normalized_size(limb, size);
+    return OK;
+}
+
+int bignum_range_product(bignum_t *product, uint64_t lo, uint64_t hi) {
+    if (hi - lo <= RANGE_PRODUCT_LEAF) {
+        if (bignum_init(product, 1))
+            return ERR;
+        // gather factors into single limbs first
+        uint64_t pending = 1;
+        for (uint64_t k = lo; k < hi; ++k) {
+            if (pending * k > UINT32_MAX) {
+                if (bignum_mul_small(product, pending))
+                    return ERR;
+                pending = k;
+            } else {
+                pending *= k;
+            }
+        }
+        return bignum_mul_small(product, pending);
+    }
+
+    bignum_t left, right;
+    uint64_t mid = lo + (hi - lo) / 2;
+    int err = ERR;
+    if (bignum_range_product(&left, lo, mid))
+        return ERR;
+    if (bignum_range_product(&right, mid, hi))
+        goto DESTROY_LEFT;
+    err = bignum_mul(product, &left, &right);
+    bignum_destroy(&right);
+DESTROY_LEFT:
+    bignum_destroy(&left);
+    return err;
+}
+
+int bignum_print(FILE *out, const bignum_t *x) {
+    char *buf = malloc(9 * x->size + 2);
+    if (buf == NULL)
+        return ERR;
+    size_t len = sprintf(buf, "%u", x->limb[x->size - 1]);
+    for (size_t i = x->size - 1; i-- > 0;) {
+        uint32_t v = x->limb[i];
+        for (int d = 8; d >= 0; --d) {
+            buf[len + d] = '0' + v % 10;
+            v /= 10;
+        }
+        len += 9;
+    }
+    buf[len++] = '\n';
+    int err = fwrite(buf, 1, len, out) == len ? OK : ERR;
+    free(buf);
+    return err;
+}
@@ -0,0 +1,49 @@
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Non-negative integers in base 10^9, least significant limb first, so that
+// printing takes no base conversion.
+#define BIGNUM_BASE (1000000000u)
+
+typedef struct bignum {
+    uint32_t *limb;
+    size_t size;
+    size_t capacity;
+} bignum_t;
+
+int bignum_init(bignum_t *x, uint32_t value);
+
+void bignum_destroy(bignum_t *x);
+
+// x *= m
+int bignum_mul_small(bignum_t *x, uint32_t m);
+
+// product = a * b, Karatsuba for large operands. product must not alias a or b.
+int bignum_mul(bignum_t *product, const bignum_t *a, const bignum_t *b);
+
+// Product of lo, lo+1, ..., hi-1.
+int bignum_range_product(bignum_t *product, uint64_t lo, uint64_t hi);
+
+int bignum_print(FILE *out, const bignum_t *x);
+
+// Low level operations on limb arrays, for multiplications split among tasks.
+
+// r[0 .. na+nb) = a * b
+int limbs_mul(uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+
+// r[0 .. max(na, nb)] = a + b
+void limbs_add(uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+
+// r[0 .. nr) += a, returns the carry out of r
+uint32_t limbs_add_to(uint32_t *r, size_t nr, const uint32_t *a, size_t na);
+
+// r[0 .. nr) -= a, requires r >= a
+void limbs_sub_from(uint32_t *r, size_t nr, const uint32_t *a, size_t na);
+
+size_t limbs_normalized_size(const uint32_t *a, size_t n);
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "lock.h"
+
+extern void worker_name_task(void *);
+extern int thread_pool_cond_wait(thread_pool_t *, pthread_cond_t *, pthread_mutex_t *);
+
+
+#define INITIAL_BUCKETS (64)
+
+static unsigned long long call_hash(void *(*function)(void *, size_t, size_t *),
+                                    const void *arg, size_t argsz) {
+    // FNV-1a over the argument bytes, seeded with the function address
+    unsigned long long hash = 14695981039346656037ull ^ (unsigned long long)function;
+    const unsigned char *bytes = arg;
+    for (size_t i = 0; i < argsz; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+static void lru_unlink(cached_future_t *entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(struct async_cache_shard *shard, cached_future_t *entry) {
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+static void entry_free(cached_future_t *entry) {
+    free(entry->result);
+    free(entry);
+}
+
+static int shard_init(struct async_cache_shard *shard, size_t memory_cap) {
+    int err;
+    shard->memory_cap = memory_cap;
+    shard->nbuckets = INITIAL_BUCKETS;
+    shard->count = 0;
+    shard->memory = 0;
+    shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+    if ((shard->buckets = calloc(shard->nbuckets, sizeof(*shard->buckets))) == NULL)
+        return ERR;
+    if ((err = _mutex_init(&shard->lock, &shard->lock_attr)))
+        goto FREE_BUCKETS;
+    if ((err = pthread_cond_init(&shard->on_result, NULL)))
+        goto DESTROY_LOCK;
+    return OK;
+
+DESTROY_LOCK:
+    _mutex_destroy(&shard->lock, &shard->lock_attr);
+FREE_BUCKETS:
+    free(shard->buckets);
+    return err;
+}
+
+static void shard_destroy(struct async_cache_shard *shard) {
+    for (cached_future_t *entry = shard->lru.lru_next; entry != &shard->lru;) {
+        cached_future_t *next = entry->lru_next;
+        entry_free(entry);
+        entry = next;
+    }
+    free(shard->buckets);
+    pthread_cond_destroy(&shard->on_result);
+    _mutex_destroy(&shard->lock, &shard->lock_attr);
+}
+
+int async_cache_init(async_cache_t *cache, size_t nshards, size_t memory_cap) {
+    if (nshards == 0)
+        return ERR;
+    cache->nshards = nshards;
+    if ((cache->shards = calloc(nshards, sizeof(*cache->shards))) == NULL)
+        return ERR;
+    for (size_t i = 0; i < nshards; ++i) {
+        if (shard_init(&cache->shards[i], memory_cap / nshards)) {
+            while (i--)
+                shard_destroy(&cache->shards[i]);
+            free(cache->shards);
+            return ERR;
+        }
+    }
+    return OK;
+}
+
+void async_cache_destroy(async_cache_t *cache) {
+    for (size_t i = 0; i < cache->nshards; ++i)
+        shard_destroy(&cache->shards[i]);
+    free(cache->shards);
+}
+
+static cached_future_t **shard_bucket(struct async_cache_shard *shard,
+                                      unsigned long long hash) {
+    return &shard->buckets[(hash / 7) % shard->nbuckets];
+}
+
+// Called with the shard lock held.
+static void shard_remove(struct async_cache_shard *shard, cached_future_t *entry) {
+    cached_future_t **ptr = shard_bucket(shard, entry->hash);
+    while (*ptr != entry)
+        ptr = &(*ptr)->hash_next;
+    *ptr = entry->hash_next;
+    lru_unlink(entry);
+    shard->count--;
+    shard->memory -= entry->memory;
+}
+
+// Called with the shard lock held; a failed resize only makes chains longer.
+static void shard_grow(struct async_cache_shard *shard) {
+    size_t old_nbuckets = shard->nbuckets;
+    cached_future_t **old = shard->buckets;
+    cached_future_t **buckets = calloc(2 * old_nbuckets, sizeof(*buckets));
+    if (buckets == NULL)
+        return;
+    shard->buckets = buckets;
+    shard->nbuckets = 2 * old_nbuckets;
+    for (size_t i = 0; i < old_nbuckets; ++i) {
+        for (cached_future_t *entry = old[i]; entry;) {
+            cached_future_t *next = entry->hash_next;
+            cached_future_t **bucket = shard_bucket(shard, entry->hash);
+            entry->hash_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(old);
+}
+
+// Called with the shard lock held. Results still being computed stay.
+static void shard_evict(struct async_cache_shard *shard) {
+    cached_future_t *entry = shard->lru.lru_prev;
+    while (shard->memory > shard->memory_cap && entry != &shard->lru) {
+        cached_future_t *prev = entry->lru_prev;
+        if (entry->finished) {
+            shard_remove(shard, entry);
+            entry->evicted = 1;
+            if (entry->refs == 0)
+                entry_free(entry);
+        }
+        entry = prev;
+    }
+}
+
+static void run_cached_call(void *arg, __attribute__((unused)) size_t argsz) {
+    cached_future_t *entry = arg;
+    struct async_cache_shard *shard = entry->shard;
+    size_t result_size = 0;
+    worker_name_task((void *)entry->function);
+    void *result = entry->function(entry->arg, entry->argsz, &result_size);
+
+    FE(robust_mutex_lock(&shard->lock));
+    entry->result = result;
+    entry->result_size = result_size;
+    entry->finished = 1;
+    entry->memory += result_size;
+    if (!entry->evicted)
+        shard->memory += result_size;
+    // the running call holds a reference of its own
+    entry->refs--;
+    shard_evict(shard);
+    FE(pthread_cond_broadcast(&shard->on_result));
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int async_cached(async_cache_t *cache, thread_pool_t *pool,
+                 cached_future_t **future, callable_t callable) {
+    int err;
+    unsigned long long hash = call_hash(callable.function, callable.arg, callable.argsz);
+    struct async_cache_shard *shard = &cache->shards[hash % cache->nshards];
+
+    if ((err = robust_mutex_lock(&shard->lock)))
+        return err;
+    for (cached_future_t *entry = *shard_bucket(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->function == callable.function
+                && entry->argsz == callable.argsz
+                && memcmp(entry->arg, callable.arg, callable.argsz) == 0) {
+            entry->refs++;
+            lru_unlink(entry);
+            lru_push_front(shard, entry);
+            pthread_mutex_unlock(&shard->lock);
+            *future = entry;
+            return OK;
+        }
+    }
+
+    cached_future_t *entry = calloc(1, sizeof(*entry) + callable.argsz);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return ERR;
+    }
+    entry->shard = shard;
+    entry->pool = pool;
+    entry->function = callable.function;
+    entry->arg = entry + 1;
+    entry->argsz = callable.argsz;
+    memcpy(entry->arg, callable.arg, callable.argsz);
+    entry->hash = hash;
+    entry->refs = 2;
+    entry->memory = sizeof(*entry) + callable.argsz;
+
+    cached_future_t **bucket = shard_bucket(shard, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->memory += entry->memory;
+    if (++shard->count > 2 * shard->nbuckets)
+        shard_grow(shard);
+    shard_evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+
+    runnable_t runnable = {.function = run_cached_call,
+                           .arg = entry,
+                           .argsz = sizeof(*entry)};
+    if ((err = defer(pool, runnable))) {
+        FE(robust_mutex_lock(&shard->lock));
+        // others may have found it already, let them see a NULL result
+        shard_remove(shard, entry);
+        entry->evicted = 1;
+        entry->finished = 1;
+        entry->refs -= 2;
+        FE(pthread_cond_broadcast(&shard->on_result));
+        if (entry->refs == 0)
+            entry_free(entry);
+        pthread_mutex_unlock(&shard->lock);
+        return err;
+    }
+    *future = entry;
+    return OK;
+}
+
+void *await_cached(cached_future_t *future) {
+    struct async_cache_shard *shard = future->shard;
+    FE(robust_mutex_lock(&shard->lock));
+    while (!future->finished)
+        FE(thread_pool_cond_wait(future->pool, &shard->on_result, &shard->lock));
+    void *result = future->result;
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+void cached_future_release(cached_future_t *future) {
+    struct async_cache_shard *shard = future->shard;
+    FE(robust_mutex_lock(&shard->lock));
+    int last = --future->refs == 0 && future->evicted;
+    pthread_mutex_unlock(&shard->lock);
+    if (last)
+        entry_free(future);
+}
@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "future.h"
+
+// Result of a call shared by everybody who asked for the same function with
+// the same argument bytes.
+typedef struct cached_future {
+    struct cached_future *hash_next;
+    struct cached_future *lru_prev, *lru_next;
+    struct async_cache_shard *shard;
+    // pool computing the result
+    thread_pool_t *pool;
+    void *(*function)(void *, size_t, size_t *);
+    void *arg;
+    size_t argsz;
+    unsigned long long hash;
+    int finished;
+    int evicted;
+    size_t refs;
+    void *result;
+    size_t result_size;
+    size_t memory;
+} cached_future_t;
+
+struct async_cache_shard {
+    pthread_mutex_t lock;
+    pthread_mutexattr_t lock_attr;
+    pthread_cond_t on_result;
+    cached_future_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    // most recently used first
+    cached_future_t lru;
+    size_t memory;
+    size_t memory_cap;
+};
+
+// Finished results are evicted in least recently used order once a shard
+// holds more than memory_cap / nshards bytes of entries, arguments and
+// results (as reported through the result size). Results have to be
+// allocated with malloc, the cache frees them on eviction.
+typedef struct async_cache {
+    size_t nshards;
+    struct async_cache_shard *shards;
+} async_cache_t;
+
+int async_cache_init(async_cache_t *cache, size_t nshards, size_t memory_cap);
+
+// All futures have to be released beforehand.
+void async_cache_destroy(async_cache_t *cache);
+
+// Like async, but when an identical call (same function, same argument
+// bytes) is in flight or finished, returns its future instead of scheduling
+// a new one. Argument bytes are copied.
+int async_cached(async_cache_t *cache, thread_pool_t *pool,
+                 cached_future_t **future, callable_t callable);
+
+// The result stays owned by the cache, valid until the future is released.
+void *await_cached(cached_future_t *future);
+
+void cached_future_release(cached_future_t *future);
+
+#endif
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <execinfo.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "counters.h"
+#include "lock.h"
+
+// task functions told apart by each worker, the rest is counted together
+#define COUNTER_FUNCTIONS (128)
+
+struct worker_counters {
+    int tried;
+    // group of the counters which could be opened, led by the first one
+    int count;
+    int fds[TASK_COUNTERS];
+    enum task_counter kinds[TASK_COUNTERS];
+    unsigned long long start_ns;
+    unsigned long long start[TASK_COUNTERS];
+    // written only by the worker
+    task_counters_entry_t table[COUNTER_FUNCTIONS];
+    task_counters_entry_t other;
+};
+
+struct task_counters {
+    int enabled;
+    unsigned available;
+    size_t nworkers;
+    struct worker_counters workers[];
+};
+
+extern unsigned long long watchdog_clock(void);
+
+static const struct {
+    __u32 type;
+    __u64 config;
+} counter_events[TASK_COUNTERS] = {
+    [TASK_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [TASK_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [TASK_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [TASK_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static int open_counter(enum task_counter kind, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[kind].type;
+    attr.config = counter_events[kind].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    // context switches happen in the kernel, the rest can be counted in
+    // user space only
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && kind != TASK_CONTEXT_SWITCHES) {
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+// Runs on the worker, so that the counters follow its thread.
+static void open_counters(struct task_counters *counters, struct worker_counters *wc) {
+    wc->tried = 1;
+    wc->count = 0;
+    for (int kind = 0; kind < TASK_COUNTERS; ++kind) {
+        int fd = open_counter(kind, wc->count ? wc->fds[0] : -1);
+        if (fd < 0)
+            continue;
+        wc->fds[wc->count] = fd;
+        wc->kinds[wc->count] = kind;
+        wc->count++;
+        __atomic_or_fetch(&counters->available, 1u << kind, __ATOMIC_RELAXED);
+    }
+}
+
+static int read_counters(struct worker_counters *wc, unsigned long long *values) {
+    __u64 buf[1 + TASK_COUNTERS];
+    ssize_t size = (1 + wc->count) * sizeof(buf[0]);
+    if (read(wc->fds[0], buf, size) != size || buf[0] != (__u64)wc->count)
+        return ERR;
+    for (int i = 0; i < wc->count; ++i)
+        values[i] = buf[1 + i];
+    return OK;
+}
+
+static task_counters_entry_t *find_entry(struct worker_counters *wc, void *function) {
+    uintptr_t hash = ((uintptr_t)function >> 4) * 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < COUNTER_FUNCTIONS; ++i) {
+        task_counters_entry_t *entry = &wc->table[(hash + i) % COUNTER_FUNCTIONS];
+        if (entry->function == function)
+            return entry;
+        if (entry->function == NULL) {
+            __atomic_store_n(&entry->function, function, __ATOMIC_RELEASE);
+            return entry;
+        }
+    }
+    return &wc->other;
+}
+
+static void add(unsigned long long *total, unsigned long long value) {
+    __atomic_store_n(total, *total + value, __ATOMIC_RELAXED);
+}
+
+// Called by the worker before each task; returns whether to call
+// thread_pool_counters_end after it.
+int thread_pool_counters_begin(thread_pool_t *pool, worker_t *worker) {
+    struct task_counters *counters = __atomic_load_n(&pool->counters, __ATOMIC_ACQUIRE);
+    if (counters == NULL || !__atomic_load_n(&counters->enabled, __ATOMIC_RELAXED))
+        return 0;
+    struct worker_counters *wc = &counters->workers[worker->id];
+    if (!wc->tried)
+        open_counters(counters, wc);
+    if (wc->count && read_counters(wc, wc->start)) {
+        // counters which cannot be read are not worth retrying every task
+        for (int i = 0; i < wc->count; ++i)
+            close(wc->fds[i]);
+        wc->count = 0;
+    }
+    wc->start_ns = watchdog_clock();
+    return 1;
+}
+
+void thread_pool_counters_end(thread_pool_t *pool, worker_t *worker, void *function) {
+    unsigned long long ns = watchdog_clock();
+    unsigned long long values[TASK_COUNTERS];
+    struct worker_counters *wc = &pool->counters->workers[worker->id];
+    int counted = wc->count && read_counters(wc, values) == OK;
+    task_counters_entry_t *entry = find_entry(wc, function);
+    __atomic_store_n(&entry->runs, entry->runs + 1, __ATOMIC_RELAXED);
+    add(&entry->ns, ns - wc->start_ns);
+    for (int i = 0; counted && i < wc->count; ++i)
+        add(&entry->counters[wc->kinds[i]], values[i] - wc->start[i]);
+}
+
+// Called by thread_pool_destroy once the workers are gone.
+void thread_pool_counters_free(thread_pool_t *pool) {
+    struct task_counters *counters = pool->counters;
+    if (counters == NULL)
+        return;
+    for (size_t i = 0; i < counters->nworkers; ++i)
+        for (int j = 0; j < counters->workers[i].count; ++j)
+            close(counters->workers[i].fds[j]);
+    free(counters);
+    pool->counters = NULL;
+}
+
+int thread_pool_counters_start(thread_pool_t *pool) {
+    int err = OK;
+    FE(robust_mutex_lock(&pool->spawn_lock));
+    struct task_counters *counters = pool->counters;
+    if (counters == NULL && pool->allow_adding) {
+        counters = calloc(1, sizeof(*counters)
+                             + pool->pool_size * sizeof(counters->workers[0]));
+        if (counters) {
+            counters->nworkers = pool->pool_size;
+            __atomic_store_n(&pool->counters, counters, __ATOMIC_RELEASE);
+        }
+    }
+    if (counters)
+        __atomic_store_n(&counters->enabled, 1, __ATOMIC_RELAXED);
+    else
+        err = ERR;
+    pthread_mutex_unlock(&pool->spawn_lock);
+    return err;
+}
+
+void thread_pool_counters_stop(thread_pool_t *pool) {
+    struct task_counters *counters = __atomic_load_n(&pool->counters, __ATOMIC_ACQUIRE);
+    if (counters)
+        __atomic_store_n(&counters->enabled, 0, __ATOMIC_RELAXED);
+}
+
+unsigned thread_pool_counters_available(thread_pool_t *pool) {
+    struct task_counters *counters = __atomic_load_n(&pool->counters, __ATOMIC_ACQUIRE);
+    return counters ? __atomic_load_n(&counters->available, __ATOMIC_RELAXED) : 0;
+}
+
+static void merge(task_counters_entry_t *into, task_counters_entry_t *entry) {
+    into->runs += __atomic_load_n(&entry->runs, __ATOMIC_RELAXED);
+    into->ns += __atomic_load_n(&entry->ns, __ATOMIC_RELAXED);
+    for (int i = 0; i < TASK_COUNTERS; ++i)
+        into->counters[i] += __atomic_load_n(&entry->counters[i], __ATOMIC_RELAXED);
+}
+
+static int by_time(const void *a, const void *b) {
+    const task_counters_entry_t *x = a, *y = b;
+    return x->ns < y->ns ? 1 : x->ns > y->ns ? -1 : 0;
+}
+
+// Returns every function seen by any worker, the rest under NULL, unsorted.
+static task_counters_entry_t *collect(struct task_counters *counters, size_t *count) {
+    size_t capacity = counters->nworkers * (COUNTER_FUNCTIONS + 1);
+    task_counters_entry_t *all = calloc(capacity + 1, sizeof(*all));
+    if (all == NULL)
+        return NULL;
+    *count = 0;
+    for (size_t w = 0; w < counters->nworkers; ++w) {
+        struct worker_counters *wc = &counters->workers[w];
+        for (size_t i = 0; i <= COUNTER_FUNCTIONS; ++i) {
+            task_counters_entry_t *entry = i < COUNTER_FUNCTIONS ? &wc->table[i] : &wc->other;
+            void *function = __atomic_load_n(&entry->function, __ATOMIC_ACQUIRE);
+            if (function == NULL && __atomic_load_n(&entry->runs, __ATOMIC_RELAXED) == 0)
+                continue;
+            size_t j = 0;
+            while (j < *count && all[j].function != function)
+                j++;
+            if (j == *count) {
+                all[j].function = function;
+                (*count)++;
+            }
+            merge(&all[j], entry);
+        }
+    }
+    return all;
+}
+
+size_t thread_pool_counters_query(thread_pool_t *pool, task_counters_entry_t *entries,
+                                  size_t max) {
+    struct task_counters *counters = __atomic_load_n(&pool->counters, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    if (counters == NULL)
+        return 0;
+    task_counters_entry_t *all = collect(counters, &count);
+    if (all == NULL)
+        return 0;
+    qsort(all, count, sizeof(*all), by_time);
+    memcpy(entries, all, (count < max ? count : max) * sizeof(*all));
+    free(all);
+    return count;
+}
+
+void thread_pool_counters_dump(thread_pool_t *pool, FILE *out) {
+    struct task_counters *counters = __atomic_load_n(&pool->counters, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    if (counters == NULL)
+        return;
+    task_counters_entry_t *all = collect(counters, &count);
+    if (all == NULL)
+        return;
+    qsort(all, count, sizeof(*all), by_time);
+    void **functions = malloc(count * sizeof(*functions) + 1);
+    char **symbols = NULL;
+    if (functions) {
+        for (size_t i = 0; i < count; ++i)
+            functions[i] = all[i].function;
+        symbols = backtrace_symbols(functions, count);
+    }
+
+    unsigned available = thread_pool_counters_available(pool);
+    fprintf(out, "%10s %12s %14s %14s %6s %12s %8s  %s\n", "runs", "time us", "cycles",
+            "instructions", "IPC", "LLC misses", "switches", "function");
+    for (size_t i = 0; i < count; ++i) {
+        task_counters_entry_t *e = &all[i];
+        char ipc[16] = "-";
+        if (e->counters[TASK_CYCLES])
+            snprintf(ipc, sizeof(ipc), "%.2f",
+                     (double)e->counters[TASK_INSTRUCTIONS] / e->counters[TASK_CYCLES]);
+        fprintf(out, "%10lu %12llu %14llu %14llu %6s %12llu %8llu  %s\n", e->runs,
+                e->ns / 1000, e->counters[TASK_CYCLES], e->counters[TASK_INSTRUCTIONS], ipc,
+                e->counters[TASK_LLC_MISSES], e->counters[TASK_CONTEXT_SWITCHES],
+                e->function == NULL ? "(other)" : symbols ? symbols[i] : "?");
+    }
+    if (!(available & (1u << TASK_CYCLES)))
+        fprintf(out, "hardware counters unavailable, only time was measured\n");
+    free(symbols);
+    free(functions);
+    free(all);
+}
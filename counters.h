@@ -0,0 +1,50 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "threadpool.h"
+
+enum task_counter {
+    TASK_CYCLES,
+    TASK_INSTRUCTIONS,
+    TASK_LLC_MISSES,
+    TASK_CONTEXT_SWITCHES,
+    TASK_COUNTERS
+};
+
+// Totals over every run of one task function: the function given to defer,
+// or for tasks of async, map, executors and the like, the user function they
+// run (see worker_name_task).
+typedef struct task_counters_entry {
+    void *function;
+    unsigned long runs;
+    unsigned long long ns;
+    // 0 for counters the kernel did not provide
+    unsigned long long counters[TASK_COUNTERS];
+} task_counters_entry_t;
+
+// Each worker opens perf_event_open counters for its own thread and reads
+// them before and after every task, adding the difference to the entry of
+// the task function. Every read is a system call, so this is meant for
+// profiling runs. When perf events are denied (see perf_event_paranoid) or
+// the machine has no PMU, only time is measured. Counters stay until the
+// pool is destroyed; starting again adds to them.
+int thread_pool_counters_start(thread_pool_t *pool);
+
+void thread_pool_counters_stop(thread_pool_t *pool);
+
+// Bit 1 << counter is set when some worker could open that counter.
+unsigned thread_pool_counters_available(thread_pool_t *pool);
+
+// Fills up to max entries, most time consuming first, and returns the
+// number of task functions seen.
+size_t thread_pool_counters_query(thread_pool_t *pool, task_counters_entry_t *entries,
+                                  size_t max);
+
+// Prints the entries with function symbols (link with -rdynamic to get
+// names of non-exported functions).
+void thread_pool_counters_dump(thread_pool_t *pool, FILE *out);
+
+#endif
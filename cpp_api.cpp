@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "async.hpp"
+// minunit reports failures as char *
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static char *test_submit() {
+  asyncc::pool pool(2);
+  sem_t done;
+  sem_init(&done, 0, 0);
+  int small = 0;
+  // a pointer and an int fit in the runnable_t itself
+  int *target = &small;
+  pool.submit([target, &done] { *target = 42; sem_post(&done); });
+  sem_wait(&done);
+  mu_assert("small closure not run", small == 42);
+
+  std::vector<int> numbers(100, 1);
+  int sum = 0;
+  pool.submit([numbers, &sum, &done] {
+    for (int n : numbers)
+      sum += n;
+    sem_post(&done);
+  });
+  sem_wait(&done);
+  mu_assert("large closure not run", sum == 100);
+  sem_destroy(&done);
+  return 0;
+}
+
+static char *test_typed_futures() {
+  asyncc::pool pool(3);
+  auto answer = asyncc::async(pool, [] { return 6 * 7; });
+  mu_assert("wrong int result", answer.get() == 42);
+  mu_assert("future still valid after get", !answer.valid());
+
+  auto owned = asyncc::async(pool, [] { return std::make_unique<std::string>("moved"); });
+  std::unique_ptr<std::string> text = owned.get();
+  mu_assert("wrong move-only result", *text == "moved");
+
+  auto as_long = asyncc::async<long>(pool, [] { return 7; });
+  mu_assert("wrong explicit result type", as_long.get() == 7L);
+
+  int side_effect = 0;
+  asyncc::async(pool, [&side_effect] { side_effect = 1; }).get();
+  mu_assert("void future not run", side_effect == 1);
+  return 0;
+}
+
+static char *test_then() {
+  asyncc::pool pool(2);
+  auto chained = asyncc::async(pool, [] { return 5; })
+                     .then([](int x) { return x * 2; })
+                     .then([](int x) { return std::to_string(x); });
+  mu_assert("wrong chained result", chained.get() == "10");
+
+  auto finished = asyncc::async(pool, [] { return 1; });
+  usleep(10000);
+  auto after = std::move(finished).then([](int x) { return x + 1; });
+  mu_assert("wrong result after finished parent", after.get() == 2);
+
+  auto failing = asyncc::async(pool, []() -> int { throw std::runtime_error("boom"); })
+                     .then([](int x) { return x + 1; });
+  bool thrown = false;
+  try {
+    failing.get();
+  } catch (const std::runtime_error &e) {
+    thrown = std::string(e.what()) == "boom";
+  }
+  mu_assert("exception not propagated through then", thrown);
+  return 0;
+}
+
+static bool no_state(void (*use)(asyncc::future<int> &)) {
+  asyncc::future<int> empty;
+  try {
+    use(empty);
+  } catch (const std::future_error &e) {
+    return e.code() == std::future_errc::no_state;
+  }
+  return false;
+}
+
+static char *test_empty_future() {
+  mu_assert("get on an empty future", no_state([](asyncc::future<int> &f) { f.get(); }));
+  mu_assert("then on an empty future",
+            no_state([](asyncc::future<int> &f) { f.then([](int x) { return x; }); }));
+
+  asyncc::pool pool(1);
+  auto read = asyncc::async(pool, [] { return 1; });
+  read.get();
+  bool thrown = false;
+  try {
+    read.get();
+  } catch (const std::future_error &) {
+    thrown = true;
+  }
+  mu_assert("second get not rejected", thrown);
+  return 0;
+}
+
+static char *test_borrowed_pool() {
+  thread_pool_t c_pool;
+  thread_pool_init(&c_pool, 2);
+  {
+    asyncc::pool borrowed(&c_pool);
+    auto f = asyncc::async(borrowed, [] { return 3; });
+    mu_assert("wrong result on borrowed pool", f.get() == 3);
+    auto unread = asyncc::async(&c_pool, [] { return 4; });
+  }
+  thread_pool_destroy(&c_pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_submit);
+  mu_run_test(test_typed_futures);
+  mu_run_test(test_then);
+  mu_run_test(test_empty_future);
+  mu_run_test(test_borrowed_pool);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
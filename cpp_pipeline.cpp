@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "pipeline.hpp"
+// minunit reports failures as char *
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#include "minunit.h"
+
+int tests_run = 0;
+
+template <class T, class = void>
+struct pipes_into_future : std::false_type {};
+template <class T>
+struct pipes_into_future<T, std::void_t<decltype(std::declval<asyncc::future<int>>()
+                                                 | std::declval<T>())>>
+    : std::true_type {};
+
+static_assert(pipes_into_future<decltype(asyncc::boundary)>::value);
+static_assert(!pipes_into_future<int>::value, "any right operand taken by future |");
+static_assert(!pipes_into_future<std::string>::value, "any right operand taken by future |");
+
+// tasks run so far by the only worker of the pool
+static unsigned long dispatches(asyncc::pool &pool) {
+  return __atomic_load_n(&pool.native()->workers[0].task_seq, __ATOMIC_ACQUIRE);
+}
+
+static char *test_fused_chain() {
+  asyncc::pool pool(1);
+  asyncc::async(pool, [] {}).get();
+  unsigned long before = dispatches(pool);
+
+  auto result = (asyncc::source(pool, [] { return 1; })
+                 | asyncc::then([](int x) { return x + 1; })
+                 | asyncc::then([](int x) { return x * 10; })
+                 | asyncc::then([](int x) { return std::to_string(x); })
+                 | asyncc::then([](std::string s) { return s + "!"; }))
+                    .get();
+  mu_assert("wrong fused result", result == "20!");
+  mu_assert("five stages took more than one dispatch", dispatches(pool) - before == 1);
+  return 0;
+}
+
+static char *test_boundaries() {
+  asyncc::pool pool(1);
+  asyncc::async(pool, [] {}).get();
+  unsigned long before = dispatches(pool);
+
+  asyncc::future<int> result = asyncc::source(pool, [] { return 2; })
+                               | asyncc::then([](int x) { return x + 1; })
+                               | asyncc::heavy([](int x) { return x * x; })
+                               | asyncc::then([](int x) { return x - 1; })
+                               | asyncc::boundary
+                               | asyncc::then([](int x) { return x / 2; });
+  mu_assert("wrong result across boundaries", result.get() == 4);
+  mu_assert("expected three dispatches", dispatches(pool) - before == 3);
+
+  int seen = 0;
+  auto from_future = asyncc::async(pool, [] { return 3; })
+                     | asyncc::then([&seen](int x) { seen = x; })
+                     | asyncc::then([] { return 7; });
+  mu_assert("wrong result continuing a future", from_future.get() == 7 && seen == 3);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_fused_chain);
+  mu_run_test(test_boundaries);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define KEYS 8
+#define PER_KEY 2000
+
+// written without locks, only ever touched by the worker owning the key
+static int last_seen[KEYS];
+static int out_of_order;
+static int remaining;
+static pthread_t ran_on;
+
+typedef struct {
+  int key;
+  int seq;
+} keyed_task;
+
+static void record(void *arg, size_t argsz __attribute__((unused))) {
+  keyed_task *task = arg;
+  if (last_seen[task->key] != task->seq - 1)
+    __atomic_add_fetch(&out_of_order, 1, __ATOMIC_RELAXED);
+  last_seen[task->key] = task->seq;
+  __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void remember_thread(void *arg __attribute__((unused)),
+                            size_t argsz __attribute__((unused))) {
+  ran_on = pthread_self();
+  __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+}
+
+static char *test_defer_to() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+  mu_assert("worker out of range accepted",
+            defer_to(&pool, 4, (runnable_t){.function = remember_thread}) != 0);
+
+  remaining = 1;
+  mu_assert("defer_to failed",
+            defer_to(&pool, 2, (runnable_t){.function = remember_thread}) == 0);
+  while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE))
+    sched_yield();
+  mu_assert("workers up to the target not spawned", pool.spawned >= 3);
+  mu_assert("ran on a different worker", pthread_equal(ran_on, pool.workers[2].thread));
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_keyed_order() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+  keyed_task *tasks = malloc(KEYS * PER_KEY * sizeof(keyed_task));
+  for (int k = 0; k < KEYS; ++k)
+    last_seen[k] = -1;
+  out_of_order = 0;
+  remaining = KEYS * PER_KEY;
+
+  for (int i = 0; i < PER_KEY; ++i) {
+    for (int k = 0; k < KEYS; ++k) {
+      keyed_task *task = &tasks[i * KEYS + k];
+      *task = (keyed_task){.key = k, .seq = i};
+      runnable_t runnable = {.function = record, .arg = task, .argsz = sizeof(*task)};
+      mu_assert("defer_keyed failed", defer_keyed(&pool, k, runnable) == 0);
+    }
+  }
+  while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE))
+    sched_yield();
+  mu_assert("tasks of a key ran out of order", out_of_order == 0);
+
+  thread_pool_destroy(&pool);
+  free(tasks);
+  return 0;
+}
+
+static int gate_state;
+static int inbox_ran;
+static int inbox_ran_before_shared;
+static thread_pool_t *gated_pool;
+
+// Holds the worker until released (or the pool is being destroyed), so that
+// tasks pile up behind it.
+static void gate(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  __atomic_store_n(&gate_state, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&gate_state, __ATOMIC_ACQUIRE) == 1
+         && __atomic_load_n(&gated_pool->allow_adding, __ATOMIC_ACQUIRE))
+    sched_yield();
+  // give thread_pool_destroy the time to queue the stop tasks
+  usleep(10000);
+}
+
+static void count_inbox(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  __atomic_add_fetch(&inbox_ran, 1, __ATOMIC_RELAXED);
+}
+
+static void mark_shared(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  inbox_ran_before_shared = __atomic_load_n(&inbox_ran, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void start_gate(thread_pool_t *pool) {
+  gated_pool = pool;
+  gate_state = 0;
+  inbox_ran = 0;
+  defer(pool, (runnable_t){.function = gate});
+  while (!__atomic_load_n(&gate_state, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+static char *test_destroy_runs_inbox() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  start_gate(&pool);
+  for (int i = 0; i < 100; ++i)
+    mu_assert("defer_to failed", defer_to(&pool, 0, (runnable_t){.function = count_inbox}) == 0);
+  thread_pool_destroy(&pool);
+  mu_assert("inbox tasks dropped", inbox_ran == 100);
+  return 0;
+}
+
+static char *test_inbox_does_not_starve_shared() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  start_gate(&pool);
+  for (int i = 0; i < 1000; ++i)
+    mu_assert("defer_to failed", defer_to(&pool, 0, (runnable_t){.function = count_inbox}) == 0);
+  remaining = 1;
+  defer(&pool, (runnable_t){.function = mark_shared});
+  __atomic_store_n(&gate_state, 2, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE))
+    sched_yield();
+  mu_assert("shared task waited for the whole inbox",
+            inbox_ran_before_shared <= INBOX_BATCH);
+  thread_pool_destroy(&pool);
+  mu_assert("inbox tasks dropped", inbox_ran == 1000);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_defer_to);
+  mu_run_test(test_keyed_order);
+  mu_run_test(test_destroy_runs_inbox);
+  mu_run_test(test_inbox_does_not_starve_shared);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,110 @@
+#include "executor.h"
+#include "lock.h"
+
+extern void deque_init(deque_t *d);
+extern void deque_destroy(deque_t *d);
+extern int deque_push_back(deque_t *d, runnable_t * val);
+extern int deque_pop_front(deque_t *d, runnable_t * val);
+extern int deque_pop_back(deque_t *d, runnable_t * val);
+extern void worker_name_task(void *);
+extern int thread_pool_sem_wait(thread_pool_t *, sem_t *);
+
+static void executor_turn(void *, size_t);
+
+int executor_init(executor_t *executor, thread_pool_t *pool,
+                  size_t max_concurrency, size_t weight) {
+    if (max_concurrency == 0 || weight == 0)
+        return ERR;
+    executor->pool = pool;
+    executor->max_concurrency = max_concurrency;
+    executor->weight = weight;
+    executor->running = 0;
+    executor->allow_adding = 1;
+    if (sem_init(&executor->on_idle, 0, 0))
+        return ERR;
+    if (_mutex_init(&executor->lock, &executor->lock_attr)) {
+        sem_destroy(&executor->on_idle);
+        return ERR;
+    }
+    deque_init(&executor->queue);
+    return OK;
+}
+
+// Called with executor->lock held, when one of the turns is over.
+static int executor_release_turn(executor_t *executor) {
+    executor->running--;
+    return executor->running == 0 && !executor->allow_adding;
+}
+
+static void executor_turn(void *arg, __attribute__((unused)) size_t argsz) {
+    executor_t *executor = arg;
+    runnable_t task;
+    runnable_t turn = {.function = executor_turn,
+                       .arg = executor,
+                       .argsz = sizeof(*executor)};
+
+    do {
+        for (size_t i = 0; i < executor->weight; ++i) {
+            FE(robust_mutex_lock(&executor->lock));
+            if (deque_pop_front(&executor->queue, &task) == DEQUE_EMPTY) {
+                int idle = executor_release_turn(executor);
+                pthread_mutex_unlock(&executor->lock);
+                if (idle)
+                    FE(sem_post(&executor->on_idle));
+                return;
+            }
+            pthread_mutex_unlock(&executor->lock);
+            // each task gets the worker arena to itself, as when run by the pool
+            worker_arena_scope_t scope = worker_arena_scope_begin();
+            worker_name_task((void *)task.function);
+            task.function(task.arg, task.argsz);
+            worker_arena_scope_end(scope);
+        }
+        // Quantum used up, let other users of the pool run before continuing.
+        // A pool which is being destroyed takes no more tasks; then the turn
+        // goes on here, so that the queued tasks are not lost.
+    } while (defer(executor->pool, turn) != OK);
+}
+
+int executor_defer(executor_t *executor, runnable_t runnable) {
+    int err;
+    if ((err = robust_mutex_lock(&executor->lock)))
+        return err;
+    if (!executor->allow_adding) {
+        pthread_mutex_unlock(&executor->lock);
+        return ERR;
+    }
+    if ((err = deque_push_back(&executor->queue, &runnable))) {
+        pthread_mutex_unlock(&executor->lock);
+        return err;
+    }
+    if (executor->running < executor->max_concurrency) {
+        runnable_t turn = {.function = executor_turn,
+                           .arg = executor,
+                           .argsz = sizeof(*executor)};
+        // the lock is held, so that a task which the pool refused to run
+        // is still the last one queued and can be taken back
+        if ((err = defer(executor->pool, turn))) {
+            deque_pop_back(&executor->queue, &runnable);
+            pthread_mutex_unlock(&executor->lock);
+            return err;
+        }
+        executor->running++;
+    }
+    pthread_mutex_unlock(&executor->lock);
+    return OK;
+}
+
+void executor_destroy(executor_t *executor) {
+    FE(robust_mutex_lock(&executor->lock));
+    executor->allow_adding = 0;
+    int busy = executor->running > 0;
+    pthread_mutex_unlock(&executor->lock);
+
+    if (busy) {
+        FE(thread_pool_sem_wait(executor->pool, &executor->on_idle));
+    }
+    deque_destroy(&executor->queue);
+    sem_destroy(&executor->on_idle);
+    _mutex_destroy(&executor->lock, &executor->lock_attr);
+}
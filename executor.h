@@ -0,0 +1,36 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "threadpool.h"
+
+// Lightweight task queue scheduled on the workers of a shared thread_pool_t.
+// No threads are created; at most max_concurrency tasks of one executor run
+// at a time, and every turn on a worker runs up to weight tasks before the
+// executor goes back to the end of the pool queue, so executors sharing
+// a pool get worker time proportional to their weights.
+typedef struct executor {
+    thread_pool_t *pool;
+    deque_t queue;
+    pthread_mutex_t lock;
+    pthread_mutexattr_t lock_attr;
+    sem_t on_idle;
+    size_t max_concurrency;
+    size_t weight;
+    size_t running;
+    short allow_adding;
+} executor_t;
+
+int executor_init(executor_t *executor, thread_pool_t *pool,
+                  size_t max_concurrency, size_t weight);
+
+// Waits for already deferred tasks to finish. Must not be called from a task
+// of the same executor.
+void executor_destroy(executor_t *executor);
+
+int executor_defer(executor_t *executor, runnable_t runnable);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "executor.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define NTASKS 1000
+
+struct counters {
+    int running;
+    int max_running;
+    int done;
+};
+
+static void count_concurrency(void *args, size_t argsz __attribute__((unused))) {
+  struct counters *c = args;
+  int now = __atomic_add_fetch(&c->running, 1, __ATOMIC_SEQ_CST);
+  int max = __atomic_load_n(&c->max_running, __ATOMIC_SEQ_CST);
+  while (now > max && !__atomic_compare_exchange_n(&c->max_running, &max, now, 0,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  __atomic_sub_fetch(&c->running, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&c->done, 1, __ATOMIC_SEQ_CST);
+}
+
+static char *test_concurrency_limit() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+
+  executor_t serial, wide;
+  mu_assert("init failed", executor_init(&serial, &pool, 1, 1) == 0);
+  mu_assert("init failed", executor_init(&wide, &pool, 4, 8) == 0);
+
+  struct counters s = {0}, w = {0};
+  for (int i = 0; i < NTASKS; ++i) {
+    executor_defer(&serial, (runnable_t){.function = count_concurrency,
+                                         .arg = &s,
+                                         .argsz = sizeof(s)});
+    executor_defer(&wide, (runnable_t){.function = count_concurrency,
+                                       .arg = &w,
+                                       .argsz = sizeof(w)});
+  }
+
+  executor_destroy(&serial);
+  executor_destroy(&wide);
+
+  mu_assert("serial executor ran tasks concurrently", s.max_running == 1);
+  mu_assert("not all tasks finished", s.done == NTASKS && w.done == NTASKS);
+  mu_assert("limit exceeded", w.max_running <= 4);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_destroy_idle() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  for (int i = 0; i < NTASKS; ++i) {
+    executor_t executor;
+    mu_assert("init failed", executor_init(&executor, &pool, 2, 1) == 0);
+    executor_destroy(&executor);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void count_slowly(void *args, size_t argsz __attribute__((unused))) {
+  int *done = args;
+  if (__atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST) == 1)
+    usleep(20000);
+}
+
+static char *test_pool_destroyed_first() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  executor_t executor;
+  executor_init(&executor, &pool, 1, 1);
+
+  int done = 0;
+  for (int i = 0; i < 100; ++i)
+    executor_defer(&executor, (runnable_t){.function = count_slowly, .arg = &done});
+  // the turn can not be requeued any more, so it has to run the rest
+  thread_pool_destroy(&pool);
+  mu_assert("queued tasks dropped", done == 100);
+
+  executor_destroy(&executor);
+  return 0;
+}
+
+static char *test_refused_task_not_kept() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  thread_pool_destroy(&pool);
+  executor_t executor;
+  executor_init(&executor, &pool, 1, 1);
+
+  int done = 0;
+  mu_assert("task accepted without a pool",
+            executor_defer(&executor, (runnable_t){.function = count_slowly, .arg = &done}) != 0);
+  mu_assert("refused task still queued", executor.queue.size == 0);
+  mu_assert("refused turn still counted", executor.running == 0);
+
+  executor_destroy(&executor);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_concurrency_limit);
+  mu_run_test(test_destroy_idle);
+  mu_run_test(test_pool_destroyed_first);
+  mu_run_test(test_refused_task_not_kept);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
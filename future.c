@@ -1,19 +1,28 @@
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include "future.h"
+#include "lock.h"
 
-extern int robust_mutex_lock(pthread_mutex_t*);
-extern int _mutex_init(pthread_mutex_t *, pthread_mutexattr_t *);
-extern void _mutex_destroy(pthread_mutex_t *, pthread_mutexattr_t *);
+extern void worker_mark_awaiting(int);
+extern int thread_pool_sem_wait(thread_pool_t *, sem_t *);
+extern void worker_name_task(void *);
 static int async_internal(thread_pool_t *, future_t* , callable_t, int);
 
 typedef void *(*function_t)(void *);
 
+// future computed by the calling thread
+static __thread future_t *current_future;
 
-static int future_init(future_t * future) {
+
+// Also used by reactor.c, which completes futures of I/O requests.
+int future_init(future_t * future) {
     future->finished = 0;
     future->cont = (__typeof((future->cont))){};
+    future->pool = NULL;
+    future->iterations_left = 0;
+    future->done = NULL;
     int err = sem_init(&future->on_result, 0 /*pshared*/, 0 /*initial value*/);
     if (err)
         return err;
@@ -29,12 +38,8 @@ static void future_destroy(future_t* future) {
     FE(sem_destroy(&future->on_result));
 }
 
-void func_to_defer_async(void * ptr, __attribute__((unused)) size_t size) {
-    future_t * future = ptr;
+void future_complete(future_t *future, void *result) {
     sem_t * on_result = &future->on_result;
-    callable_t * callable = &future->callable;
-
-    void* result = callable->function(callable->arg, callable->argsz, &future->result_size);
 
     FE(robust_mutex_lock(&future->lock));
     future->result = result;
@@ -54,12 +59,48 @@ void func_to_defer_async(void * ptr, __attribute__((unused)) size_t size) {
     }
 }
 
+static void* future_run(future_t *future) {
+    callable_t * callable = &future->callable;
+    // a task awaiting a pool of size 0 runs other futures' tasks in between
+    future_t *outer = current_future;
+    current_future = future;
+    worker_name_task((void *)callable->function);
+    void* result = callable->function(callable->arg, callable->argsz, &future->result_size);
+    current_future = outer;
+    return result;
+}
+
+void func_to_defer_async(void * ptr, __attribute__((unused)) size_t size) {
+    future_t * future = ptr;
+    future_complete(future, future_run(future));
+}
+
+static void func_to_defer_iterate(void * ptr, __attribute__((unused)) size_t size) {
+    future_t * future = ptr;
+    void* result = future_run(future);
+
+    int more = future->done ? !future->done(result, future->result_size)
+                            : --future->iterations_left > 0;
+    if (more) {
+        future->callable.arg = result;
+        future->callable.argsz = future->result_size;
+        runnable_t runnable = {.function = func_to_defer_iterate,
+                               .arg = future,
+                               .argsz = future->result_size};
+        FE(defer(future->pool, runnable));
+    } else {
+        future_complete(future, result);
+    }
+}
+
 
 static int async_internal(thread_pool_t *pool, future_t* future, callable_t callable, int from_mapped) {
     if (!from_mapped) {
         int err = future_init(future);
         if (err)
         return err;
+        // map set it already, and await may be reading it
+        future->pool = pool;
     }
     future->callable = callable;
     runnable_t runnable = {.function = func_to_defer_async,
@@ -72,6 +113,37 @@ int async(thread_pool_t *pool, future_t *future, callable_t callable) {
     return async_internal(pool, future, callable, 0);
 }
 
+static int async_iterate_internal(thread_pool_t *pool, future_t *future,
+                                  callable_t callable, size_t count,
+                                  int (*done)(void *, size_t)) {
+    int err = future_init(future);
+    if (err)
+        return err;
+    future->callable = callable;
+    future->pool = pool;
+    future->iterations_left = count;
+    future->done = done;
+    if (count == 0) {
+        future->result_size = callable.argsz;
+        future_complete(future, callable.arg);
+        return OK;
+    }
+    runnable_t runnable = {.function = func_to_defer_iterate,
+                           .arg = future,
+                           .argsz = callable.argsz};
+    return defer(pool, runnable);
+}
+
+int async_iterate(thread_pool_t *pool, future_t *future, callable_t callable,
+                  size_t count) {
+    return async_iterate_internal(pool, future, callable, count, NULL);
+}
+
+int async_iterate_until(thread_pool_t *pool, future_t *future, callable_t callable,
+                        int (*done)(void *, size_t)) {
+    return async_iterate_internal(pool, future, callable, 1, done);
+}
+
 int map(thread_pool_t *pool, future_t *future, future_t *from,
         void *(*function)(void *, size_t, size_t *)) {
     int err = future_init(future);
@@ -81,6 +153,7 @@ int map(thread_pool_t *pool, future_t *future, future_t *from,
     future->callable = (const callable_t){.function = function,
                                           .arg = NULL,
                                           .argsz = 0};
+    future->pool = pool;
     err = robust_mutex_lock(&from->lock);
     if (err)
         return err;
@@ -110,10 +183,30 @@ void *await(future_t *future) {
     errno = 0;
     int v;
     sem_getvalue(on_result, &v);
-    do {
-        err = sem_wait(on_result);
-    } while (err != 0 && errno == EINTR);
+    worker_mark_awaiting(1);
+    err = thread_pool_sem_wait(future->pool, on_result);
+    worker_mark_awaiting(0);
     FE(err);
     future_destroy(future);
     return future->result;
 }
+
+void *future_result_buf(void) {
+    return current_future ? current_future->inline_result : NULL;
+}
+
+void *future_return(const void *value, size_t size, size_t *retsz) {
+    void *result = NULL;
+    if (size <= FUTURE_INLINE_RESULT_SIZE)
+        result = future_result_buf();
+    if (result == NULL && (result = malloc(size)) == NULL)
+        return NULL;
+    memcpy(result, value, size);
+    *retsz = size;
+    return result;
+}
+
+void future_result_free(future_t *future, void *result) {
+    if (result != (void *)future->inline_result)
+        free(result);
+}
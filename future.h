@@ -17,6 +17,8 @@ struct continuation {
     void (*exit_handler)(void*, size_t);
 };
 
+#define FUTURE_INLINE_RESULT_SIZE (32)
+
 typedef struct future {
     callable_t callable;
     sem_t on_result;
@@ -25,7 +27,12 @@ typedef struct future {
     int finished;
     void* result;
     size_t result_size;
+    unsigned char inline_result[FUTURE_INLINE_RESULT_SIZE] __attribute__((aligned(16)));
     struct continuation cont;
+    thread_pool_t* pool;
+    // state of async_iterate
+    size_t iterations_left;
+    int (*done)(void *, size_t);
 } future_t;
 
 int async(thread_pool_t *pool, future_t *future, callable_t callable);
@@ -35,4 +42,32 @@ int map(thread_pool_t *pool, future_t *future, future_t *from,
 
 void *await(future_t *future);
 
+// Runs callable.function count times on the same future, each time with the
+// result of the previous run as its argument; the future resolves to the last
+// result (or to callable.arg when count is 0). Every step is one more defer,
+// with no new future. The argument may point to the future's inline result
+// buffer, which the step may overwrite with its own result. Nothing frees
+// the results passed from step to step: a step owns its argument, and must
+// free it or return it, unless it is callable.arg or future_result_buf().
+int async_iterate(thread_pool_t *pool, future_t *future, callable_t callable,
+                  size_t count);
+
+// Like async_iterate, but stops after the first step whose result satisfies
+// done(result, result_size).
+int async_iterate_until(thread_pool_t *pool, future_t *future, callable_t callable,
+                        int (*done)(void *, size_t));
+
+// Called from a function run by async or map, returns the buffer of
+// FUTURE_INLINE_RESULT_SIZE bytes inside the future being computed, NULL
+// elsewhere. A result returned in it needs no allocation; it stays valid as
+// long as the future's memory, including when passed on by map.
+void *future_result_buf(void);
+
+// Returns size bytes of value as the result of the running function: copied
+// into the inline buffer when they fit, into malloc'd memory otherwise.
+void *future_return(const void *value, size_t size, size_t *retsz);
+
+// Frees a result obtained from await, unless it is stored inline.
+void future_result_free(future_t *future, void *result);
+
 #endif
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "group.h"
+
+extern void worker_name_task(void *);
+extern int thread_pool_sem_wait(thread_pool_t *, sem_t *);
+
+struct group_task {
+    task_group_t *group;
+    runnable_t runnable;
+};
+
+static __thread task_group_t *current_group;
+
+int task_group_init(task_group_t *group) {
+    group->pending = 1;
+    group->error = 0;
+    group->on_done_pool = NULL;
+    group->inline_pool = NULL;
+    group->on_done = (runnable_t){0};
+    return sem_init(&group->done, 0, 0) ? ERR : OK;
+}
+
+void task_group_destroy(task_group_t *group) {
+    sem_destroy(&group->done);
+}
+
+// Whoever brings the count to zero wakes the owner; the group may be gone
+// right after that.
+static void task_group_finish(task_group_t *group) {
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    runnable_t on_done = group->on_done;
+    if (on_done.function == NULL) {
+        FE(sem_post(&group->done));
+        return;
+    }
+    if (defer(group->on_done_pool, on_done))
+        on_done.function(on_done.arg, on_done.argsz);
+}
+
+static void run_group_task(void *arg, __attribute__((unused)) size_t argsz) {
+    struct group_task *task = arg;
+    task_group_t *group = task->group;
+    runnable_t runnable = task->runnable;
+    free(task);
+    if (__atomic_load_n(&group->error, __ATOMIC_ACQUIRE) == 0) {
+        task_group_t *outer = current_group;
+        current_group = group;
+        worker_name_task((void *)runnable.function);
+        runnable.function(runnable.arg, runnable.argsz);
+        current_group = outer;
+    }
+    task_group_finish(group);
+}
+
+int task_group_defer(task_group_t *group, thread_pool_t *pool, runnable_t runnable) {
+    if (__atomic_load_n(&group->error, __ATOMIC_ACQUIRE)) {
+        errno = ECANCELED;
+        return ERR;
+    }
+    struct group_task *task = malloc(sizeof(*task));
+    if (task == NULL)
+        return ERR;
+    task->group = group;
+    task->runnable = runnable;
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+    if (pool && pool->pool_size == 0)
+        __atomic_store_n(&group->inline_pool, pool, __ATOMIC_RELAXED);
+    runnable_t wrapped = {.function = run_group_task, .arg = task, .argsz = sizeof(*task)};
+    if (defer(pool, wrapped)) {
+        free(task);
+        task_group_finish(group);
+        return ERR;
+    }
+    return OK;
+}
+
+task_group_t *task_group_current(void) {
+    return current_group;
+}
+
+void task_group_fail(task_group_t *group, int error) {
+    int none = 0;
+    __atomic_compare_exchange_n(&group->error, &none, error, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+void task_group_cancel(task_group_t *group) {
+    task_group_fail(group, ECANCELED);
+}
+
+int task_group_error(task_group_t *group) {
+    return __atomic_load_n(&group->error, __ATOMIC_ACQUIRE);
+}
+
+int task_group_wait(task_group_t *group) {
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+        // tasks of the group may be adding to it from other threads
+        thread_pool_t *inline_pool = __atomic_load_n(&group->inline_pool, __ATOMIC_RELAXED);
+        FE(thread_pool_sem_wait(inline_pool, &group->done));
+    }
+    int error = __atomic_load_n(&group->error, __ATOMIC_ACQUIRE);
+    group->error = 0;
+    group->pending = 1;
+    return error;
+}
+
+int task_group_on_done(task_group_t *group, thread_pool_t *pool, runnable_t continuation) {
+    if (continuation.function == NULL)
+        return ERR;
+    group->on_done_pool = pool;
+    group->on_done = continuation;
+    task_group_finish(group);
+    return OK;
+}
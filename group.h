@@ -0,0 +1,64 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stddef.h>
+#include <semaphore.h>
+
+#include "threadpool.h"
+
+// Tasks deferred together and waited for at once. A single counter holds
+// the number of tasks not finished yet plus one held by the owner until it
+// waits or registers a continuation, so whoever brings it to zero is the
+// only one to wake the owner: waiting for any number of tasks costs one
+// wakeup.
+//
+// The first error reported by a task, or a cancellation, is kept by the
+// group; tasks of the group which have not started by then are skipped.
+typedef struct task_group {
+    size_t pending;
+    int error;
+    sem_t done;
+    // run instead of posting done, see task_group_on_done
+    thread_pool_t *on_done_pool;
+    // pool of size 0 given tasks, whose queue task_group_wait runs
+    thread_pool_t *inline_pool;
+    runnable_t on_done;
+} task_group_t;
+
+int task_group_init(task_group_t *group);
+
+// The group must be finished, or never deferred into.
+void task_group_destroy(task_group_t *group);
+
+// Defers runnable to pool as a task of the group. Fails if the group has
+// failed or been cancelled. Once the owner waits, only tasks of the group
+// may add to it. A skipped task does not run at all, so an arg it would
+// have freed is leaked unless its owner keeps track of it.
+int task_group_defer(task_group_t *group, thread_pool_t *pool, runnable_t runnable);
+
+// Group of the task running on this thread, NULL outside of a group.
+task_group_t *task_group_current(void);
+
+// Records error (an errno value) unless the group already has one, and
+// skips the tasks which have not started yet.
+void task_group_fail(task_group_t *group, int error);
+
+// Same as task_group_fail(group, ECANCELED).
+void task_group_cancel(task_group_t *group);
+
+// Error of the group so far, 0 if none. Long tasks may poll it to stop
+// early.
+int task_group_error(task_group_t *group);
+
+// Waits for every task of the group and returns its error. The group may
+// be deferred into again afterwards, with the error cleared. Tasks deferred
+// to a pool of size 0 are run by the waiting thread (those of the last such
+// pool, if there were several).
+int task_group_wait(task_group_t *group);
+
+// Instead of waiting, defers continuation to pool once every task of the
+// group has finished; it may read task_group_error and destroy the group.
+// Runs it on the calling thread if that cannot be deferred.
+int task_group_on_done(task_group_t *group, thread_pool_t *pool, runnable_t continuation);
+
+#endif
@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hedge.h"
+#include "lock.h"
+
+// latencies of first copies kept per function, and how many are needed
+// before their 95th percentile is used as the threshold
+#define HEDGE_SAMPLES (128)
+#define HEDGE_MIN_SAMPLES (20)
+#define HEDGE_STATS_BUCKETS (64)
+
+extern int future_init(future_t *);
+extern void future_complete(future_t *, void *);
+extern unsigned long long watchdog_clock(void);
+extern void worker_name_task(void *);
+
+struct hedge_stats {
+    void *(*function)(void *, size_t, size_t *);
+    struct hedge_stats *next;
+    unsigned long long samples[HEDGE_SAMPLES];
+    size_t count;
+    unsigned long long p95_ns;
+};
+
+struct hedge;
+
+struct hedge_copy {
+    struct hedge *hedge;
+    void *arg;
+};
+
+struct hedge {
+    future_t *future;
+    thread_pool_t *pool;
+    callable_t callable;
+    struct hedge_stats *stats;
+    struct hedge_copy copies[2];
+    unsigned long long started_ns;
+    unsigned long long deadline_ns;
+    // index + 1 of the copy whose result was taken
+    int winner;
+    // one per copy started or waiting on the timer
+    int refs;
+    // on the timer list, ordered by deadline
+    int queued;
+    // taken off the list by the timer, which is starting the second copy
+    int firing;
+    struct hedge *prev, *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_mutexattr_t lock_attr;
+    pthread_cond_t changed;
+    // broadcast when the timer is done firing a hedge
+    pthread_cond_t fired;
+    struct hedge *head, *tail;
+} timer;
+
+static pthread_mutex_t stats_lock;
+static pthread_mutexattr_t stats_lock_attr;
+static struct hedge_stats *stats_buckets[HEDGE_STATS_BUCKETS];
+
+static pthread_once_t hedge_once = PTHREAD_ONCE_INIT;
+static int timer_started;
+// hedges not freed yet, which may still use their stats
+static int live_hedges;
+
+static __thread struct hedge_copy *current_copy;
+
+static int by_value(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct hedge_stats *hedge_stats(void *(*function)(void *, size_t, size_t *)) {
+    size_t bucket = ((unsigned long)function >> 4) % HEDGE_STATS_BUCKETS;
+    FE(robust_mutex_lock(&stats_lock));
+    struct hedge_stats *stats = stats_buckets[bucket];
+    while (stats && stats->function != function)
+        stats = stats->next;
+    if (stats == NULL && (stats = calloc(1, sizeof(*stats)))) {
+        stats->function = function;
+        stats->next = stats_buckets[bucket];
+        stats_buckets[bucket] = stats;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return stats;
+}
+
+static unsigned long long hedge_p95(struct hedge_stats *stats) {
+    FE(robust_mutex_lock(&stats_lock));
+    unsigned long long p95 = stats->p95_ns;
+    pthread_mutex_unlock(&stats_lock);
+    return p95;
+}
+
+static void hedge_record(struct hedge_stats *stats, unsigned long long ns) {
+    unsigned long long sorted[HEDGE_SAMPLES];
+    FE(robust_mutex_lock(&stats_lock));
+    stats->samples[stats->count++ % HEDGE_SAMPLES] = ns;
+    // the percentile is recomputed every few samples, not on every call
+    if (stats->count >= HEDGE_MIN_SAMPLES && stats->count % 8 == 0) {
+        size_t n = stats->count < HEDGE_SAMPLES ? stats->count : HEDGE_SAMPLES;
+        memcpy(sorted, stats->samples, n * sizeof(*sorted));
+        qsort(sorted, n, sizeof(*sorted), by_value);
+        stats->p95_ns = sorted[n * 95 / 100];
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Copies of the argument follow the hedge, each aligned like malloc'd memory.
+static size_t hedge_aligned(size_t size) {
+    return (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+}
+
+static void hedge_release(struct hedge *hedge) {
+    if (__atomic_sub_fetch(&hedge->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(hedge);
+        __atomic_sub_fetch(&live_hedges, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Must hold the timer lock.
+static void timer_unlink(struct hedge *hedge) {
+    *(hedge->prev ? &hedge->prev->next : &timer.head) = hedge->next;
+    *(hedge->next ? &hedge->next->prev : &timer.tail) = hedge->prev;
+    hedge->queued = 0;
+}
+
+// Deadlines mostly come in order, so the list is searched from its end.
+static void timer_insert(struct hedge *hedge) {
+    FE(robust_mutex_lock(&timer.lock));
+    struct hedge *after = timer.tail;
+    while (after && after->deadline_ns > hedge->deadline_ns)
+        after = after->prev;
+    hedge->prev = after;
+    hedge->next = after ? after->next : timer.head;
+    *(hedge->next ? &hedge->next->prev : &timer.tail) = hedge;
+    *(after ? &after->next : &timer.head) = hedge;
+    hedge->queued = 1;
+    if (timer.head == hedge)
+        FE(pthread_cond_signal(&timer.changed));
+    pthread_mutex_unlock(&timer.lock);
+}
+
+// Waits for the timer if it is starting the second copy, so once this
+// returns the pool is not used by the timer any more.
+static void timer_cancel(struct hedge *hedge) {
+    int dequeued = 0;
+    FE(robust_mutex_lock(&timer.lock));
+    if (hedge->queued) {
+        timer_unlink(hedge);
+        dequeued = 1;
+    }
+    while (hedge->firing)
+        FE(pthread_cond_wait(&timer.fired, &timer.lock));
+    pthread_mutex_unlock(&timer.lock);
+    if (dequeued)
+        hedge_release(hedge);
+}
+
+static void run_copy(void *arg, __attribute__((unused)) size_t argsz) {
+    struct hedge_copy *copy = arg;
+    struct hedge *hedge = copy->hedge;
+    size_t result_size = 0;
+
+    // copies run by an await in the function (on a pool of size 0) nest
+    struct hedge_copy *outer = current_copy;
+    current_copy = copy;
+    worker_name_task((void *)hedge->callable.function);
+    void *result = hedge->callable.function(copy->arg, hedge->callable.argsz, &result_size);
+    current_copy = outer;
+
+    int index = copy - hedge->copies;
+    if (index == 0 && hedge->stats)
+        hedge_record(hedge->stats, watchdog_clock() - hedge->started_ns);
+    int none = 0;
+    if (__atomic_compare_exchange_n(&hedge->winner, &none, index + 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        timer_cancel(hedge);
+        hedge->future->result_size = result_size;
+        future_complete(hedge->future, result);
+    } else {
+        free(result);
+    }
+    hedge_release(hedge);
+}
+
+// Called without the timer lock, so that defer does not hold up the other
+// timers, and with hedge->firing set, so that the first copy does not
+// complete the future (after which the pool may be gone) meanwhile.
+static void timer_fire(struct hedge *hedge) {
+    if (__atomic_load_n(&hedge->winner, __ATOMIC_ACQUIRE) == 0) {
+        runnable_t runnable = {.function = run_copy,
+                               .arg = &hedge->copies[1],
+                               .argsz = sizeof(hedge->copies[1])};
+        // the second copy gets a reference of its own, the timer keeps its
+        // one until it is done with the hedge
+        __atomic_add_fetch(&hedge->refs, 1, __ATOMIC_RELAXED);
+        if (defer(hedge->pool, runnable) != OK)
+            hedge_release(hedge);
+    }
+}
+
+static void *timer_thread(__attribute__((unused)) void *arg) {
+    FE(robust_mutex_lock(&timer.lock));
+    while (1) {
+        if (timer.head == NULL) {
+            FE(pthread_cond_wait(&timer.changed, &timer.lock));
+            continue;
+        }
+        unsigned long long deadline = timer.head->deadline_ns;
+        if (watchdog_clock() >= deadline) {
+            struct hedge *hedge = timer.head;
+            timer_unlink(hedge);
+            hedge->firing = 1;
+            pthread_mutex_unlock(&timer.lock);
+            timer_fire(hedge);
+            FE(robust_mutex_lock(&timer.lock));
+            hedge->firing = 0;
+            FE(pthread_cond_broadcast(&timer.fired));
+            hedge_release(hedge);
+            continue;
+        }
+        struct timespec until = {deadline / 1000000000ull, deadline % 1000000000ull};
+        int err = pthread_cond_timedwait(&timer.changed, &timer.lock, &until);
+        if (err && err != ETIMEDOUT)
+            FE(err);
+    }
+    return NULL;
+}
+
+static void hedge_init() {
+    pthread_condattr_t attr;
+    pthread_t thread;
+    FE(_mutex_init(&stats_lock, &stats_lock_attr));
+    FE(_mutex_init(&timer.lock, &timer.lock_attr));
+    FE(pthread_condattr_init(&attr));
+    FE(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+    FE(pthread_cond_init(&timer.changed, &attr));
+    pthread_condattr_destroy(&attr);
+    FE(pthread_cond_init(&timer.fired, NULL));
+
+    sigset_t blocked, old;
+    FE(sigfillset(&blocked));
+    FE(pthread_sigmask(SIG_SETMASK, &blocked, &old));
+    int err = pthread_create(&thread, NULL, timer_thread, NULL);
+    FE(pthread_sigmask(SIG_SETMASK, &old, NULL));
+    if (err)
+        return;
+    pthread_detach(thread);
+    timer_started = 1;
+}
+
+int async_hedged(thread_pool_t *pool, future_t *future, callable_t callable,
+                 unsigned long long hedge_after_ns) {
+    FE(pthread_once(&hedge_once, hedge_init));
+    struct hedge_stats *stats = hedge_stats(callable.function);
+    if (hedge_after_ns == 0 && stats)
+        hedge_after_ns = hedge_p95(stats);
+    int hedged = hedge_after_ns > 0 && timer_started;
+
+    size_t stride = hedge_aligned(callable.argsz);
+    struct hedge *hedge = malloc(hedge_aligned(sizeof(*hedge)) + 2 * stride);
+    if (hedge == NULL)
+        return ERR;
+    *hedge = (struct hedge){.future = future, .pool = pool, .callable = callable,
+                            .stats = stats, .refs = 1 + hedged};
+    for (int i = 0; i < 2; ++i) {
+        hedge->copies[i].hedge = hedge;
+        hedge->copies[i].arg = (char *)hedge + hedge_aligned(sizeof(*hedge)) + i * stride;
+        if (callable.argsz)
+            memcpy(hedge->copies[i].arg, callable.arg, callable.argsz);
+    }
+
+    int err = future_init(future);
+    if (err)
+        goto FREE;
+    future->callable = callable;
+    future->pool = pool;
+    hedge->started_ns = watchdog_clock();
+    hedge->deadline_ns = hedge->started_ns + hedge_after_ns;
+    runnable_t runnable = {.function = run_copy,
+                           .arg = &hedge->copies[0],
+                           .argsz = sizeof(hedge->copies[0])};
+    __atomic_add_fetch(&live_hedges, 1, __ATOMIC_RELAXED);
+    if ((err = defer(pool, runnable))) {
+        __atomic_sub_fetch(&live_hedges, 1, __ATOMIC_RELAXED);
+        goto DESTROY_FUTURE;
+    }
+    // if the first copy is done by now, the timer finds it won
+    if (hedged)
+        timer_insert(hedge);
+    return OK;
+
+DESTROY_FUTURE:
+    _mutex_destroy(&future->lock, &future->lock_attr);
+    sem_destroy(&future->on_result);
+FREE:
+    free(hedge);
+    return ERR;
+}
+
+int async_hedged_cancelled(void) {
+    return current_copy
+           && __atomic_load_n(&current_copy->hedge->winner, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Statistics outlive every pool, so they are freed at exit, unless some
+// hedged call is still running and may record to them.
+__attribute__((destructor)) static void hedge_free_stats() {
+    if (__atomic_load_n(&live_hedges, __ATOMIC_ACQUIRE))
+        return;
+    for (size_t i = 0; i < HEDGE_STATS_BUCKETS; ++i) {
+        while (stats_buckets[i]) {
+            struct hedge_stats *next = stats_buckets[i]->next;
+            free(stats_buckets[i]);
+            stats_buckets[i] = next;
+        }
+    }
+}
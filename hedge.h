@@ -0,0 +1,25 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include "future.h"
+
+// Like async, but if callable has not finished hedge_after_ns nanoseconds
+// after the call, a second copy of it is started on the pool and the future
+// resolves to whichever copy finishes first. The callable must be
+// idempotent. Each copy gets its own copy of the argument, so it may be
+// modified; neither copy may return a pointer into it. Results have to be
+// malloc'd (or NULL): the result of the copy which lost is freed.
+//
+// With hedge_after_ns 0 the threshold is the 95th percentile of the time the
+// first copies of earlier hedged calls to the same function took to finish;
+// until enough of them did, the call is not hedged. Timers are kept by one
+// thread, started by the first hedged call.
+int async_hedged(thread_pool_t *pool, future_t *future, callable_t callable,
+                 unsigned long long hedge_after_ns);
+
+// Called from a function run by async_hedged, tells whether the other copy
+// already won, so that the result will be discarded and the function may as
+// well return NULL right away. 0 everywhere else.
+int async_hedged_cancelled(void);
+
+#endif
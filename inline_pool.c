@@ -0,0 +1,255 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "executor.h"
+#include "future.h"
+#include "group.h"
+#include "stream.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define TASKS 20
+
+static size_t order[2 * TASKS];
+static size_t ran;
+static thread_pool_t inline_pool;
+
+static void note(void *arg, size_t argsz __attribute__((unused))) {
+  order[ran++] = (size_t)arg;
+}
+
+// Defers a task of its own, which has to run in the same round.
+static void note_and_defer(void *arg, size_t argsz) {
+  note(arg, argsz);
+  defer(&inline_pool, (runnable_t){.function = note, .arg = (void *)((size_t)arg + TASKS)});
+}
+
+static char *test_run_until_idle() {
+  thread_pool_t *pool = &inline_pool;
+  mu_assert("init failed", thread_pool_init(pool, 0) == 0);
+  ran = 0;
+  for (size_t i = 0; i < TASKS; ++i)
+    mu_assert("defer failed",
+              defer(pool, (runnable_t){.function = note_and_defer, .arg = (void *)i}) == 0);
+  mu_assert("ran before being asked", ran == 0);
+  mu_assert("wrong number of tasks run", thread_pool_run_until_idle(pool) == 2 * TASKS);
+  for (size_t i = 0; i < 2 * TASKS; ++i)
+    mu_assert("not run in order", order[i] == i);
+
+  // destroying the pool runs what is left
+  ran = 0;
+  defer(pool, (runnable_t){.function = note, .arg = (void *)7});
+  thread_pool_destroy(pool);
+  mu_assert("pending task dropped", ran == 1 && order[0] == 7);
+  return 0;
+}
+
+static pthread_t main_thread;
+
+static void *square_here(void *arg, size_t argsz __attribute__((unused)), size_t *retsz) {
+  int *value = arg;
+  if (!pthread_equal(pthread_self(), main_thread))
+    return NULL;
+  int *result = malloc(sizeof(int));
+  *result = *value * *value;
+  *retsz = sizeof(int);
+  return result;
+}
+
+static void *add_one(void *arg, size_t argsz __attribute__((unused)), size_t *retsz) {
+  int *value = arg;
+  if (value == NULL || !pthread_equal(pthread_self(), main_thread))
+    return NULL;
+  *value += 1;
+  *retsz = sizeof(int);
+  return value;
+}
+
+static char *test_await_runs_tasks() {
+  thread_pool_t pool;
+  future_t squared, plus_one;
+  thread_pool_init(&pool, 0);
+  main_thread = pthread_self();
+
+  int value = 6;
+  async(&pool, &squared, (callable_t){square_here, &value, sizeof(value)});
+  map(&pool, &plus_one, &squared, add_one);
+  int *result = await(&plus_one);
+  mu_assert("not run by the awaiting thread", result != NULL);
+  mu_assert("wrong result", *result == 37);
+  free(result);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void run_scheduled(unsigned long long seed, size_t workers,
+                          schedule_entry_t *log, size_t *length) {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 0);
+  thread_pool_schedule(&pool, workers, seed);
+  ran = 0;
+  for (size_t i = 0; i < TASKS; ++i)
+    defer(&pool, (runnable_t){.function = note, .arg = (void *)i});
+  thread_pool_run_until_idle(&pool);
+  *length = thread_pool_schedule_log(&pool, log, TASKS);
+  thread_pool_destroy(&pool);
+}
+
+static char *test_deterministic_schedule() {
+  schedule_entry_t first[TASKS], again[TASKS], other[TASKS];
+  size_t length;
+  size_t seen[TASKS] = {0};
+
+  run_scheduled(42, 4, first, &length);
+  mu_assert("wrong log length", length == TASKS);
+  for (size_t i = 0; i < TASKS; ++i) {
+    mu_assert("log differs from the run", (size_t)first[i].arg == order[i]);
+    mu_assert("not one of the oldest tasks", first[i].worker < 4);
+    mu_assert("wrong function", first[i].function == note);
+    seen[order[i]]++;
+  }
+  for (size_t i = 0; i < TASKS; ++i)
+    mu_assert("task lost or run twice", seen[i] == 1);
+
+  run_scheduled(42, 4, again, &length);
+  mu_assert("same seed, different order", memcmp(first, again, sizeof(first)) == 0);
+
+  run_scheduled(43, 4, other, &length);
+  mu_assert("seed ignored", memcmp(first, other, sizeof(first)) != 0);
+
+  // a single virtual worker takes the tasks in order
+  run_scheduled(42, 1, other, &length);
+  for (size_t i = 0; i < TASKS; ++i)
+    mu_assert("one worker out of order", (size_t)other[i].arg == i);
+  return 0;
+}
+
+static void produce(void *arg, size_t argsz __attribute__((unused))) {
+  async_stream_t *stream = arg;
+  async_stream_push(stream, (void *)5, 0);
+  async_stream_close(stream);
+}
+
+// Nothing but the waiting thread runs the tasks, so each of these waits
+// would block forever if it did not run them.
+static char *test_blocking_waits_run_tasks() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 0);
+  main_thread = pthread_self();
+
+  task_group_t group;
+  task_group_init(&group);
+  ran = 0;
+  for (size_t i = 0; i < 3; ++i)
+    task_group_defer(&group, &pool, (runnable_t){.function = note, .arg = (void *)i});
+  mu_assert("group failed", task_group_wait(&group) == 0);
+  mu_assert("group tasks not run", ran == 3);
+  task_group_destroy(&group);
+
+  async_stream_t stream;
+  struct async_stream_item item;
+  async_stream_init(&stream, &pool, 4);
+  defer(&pool, (runnable_t){.function = produce, .arg = &stream});
+  mu_assert("nothing pulled", async_stream_pull(&stream, &item, 1) == 1);
+  mu_assert("wrong value pulled", item.value == (void *)5);
+  async_stream_destroy(&stream);
+
+  async_cache_t cache;
+  cached_future_t *cached;
+  int value = 3;
+  async_cache_init(&cache, 1, 1 << 20);
+  async_cached(&cache, &pool, &cached, (callable_t){square_here, &value, sizeof(value)});
+  int *square = await_cached(cached);
+  mu_assert("wrong cached result", square != NULL && *square == 9);
+  cached_future_release(cached);
+  async_cache_destroy(&cache);
+
+  executor_t executor;
+  executor_init(&executor, &pool, 1, 1);
+  ran = 0;
+  for (size_t i = 0; i < 3; ++i)
+    executor_defer(&executor, (runnable_t){.function = note, .arg = (void *)i});
+  executor_destroy(&executor);
+  mu_assert("executor tasks not run", ran == 3);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void *scratch;
+
+static void use_arena(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  scratch = worker_arena_alloc(64);
+  if (scratch)
+    memset(scratch, 1, 64);
+}
+
+static char *test_arena_inline() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 0);
+  mu_assert("arena outside of tasks", worker_arena_alloc(64) == NULL);
+  scratch = NULL;
+  defer(&pool, (runnable_t){.function = use_arena});
+  thread_pool_run_until_idle(&pool);
+  mu_assert("no arena for a task run inline", scratch != NULL);
+  mu_assert("arena left after the task", worker_arena_alloc(64) == NULL);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static thread_pool_t nested_pool;
+static int buffer_kept;
+
+static void *inner(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                   size_t *retsz __attribute__((unused))) {
+  return NULL;
+}
+
+// Awaits a future of the same pool, whose task runs on this thread meanwhile.
+static void *outer(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                   size_t *retsz __attribute__((unused))) {
+  future_t nested;
+  void *buffer = future_result_buf();
+  async(&nested_pool, &nested, (callable_t){.function = inner});
+  await(&nested);
+  buffer_kept = buffer != NULL && future_result_buf() == buffer;
+  return NULL;
+}
+
+static char *test_nested_await() {
+  future_t future;
+  thread_pool_init(&nested_pool, 0);
+  buffer_kept = 0;
+  async(&nested_pool, &future, (callable_t){.function = outer});
+  await(&future);
+  mu_assert("result buffer lost after a nested await", buffer_kept);
+  thread_pool_destroy(&nested_pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_run_until_idle);
+  mu_run_test(test_await_runs_tasks);
+  mu_run_test(test_deterministic_schedule);
+  mu_run_test(test_blocking_waits_run_tasks);
+  mu_run_test(test_nested_await);
+  mu_run_test(test_arena_inline);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,132 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "future.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static sem_t started, release;
+
+static size_t threads() {
+  size_t count = 0;
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == NULL)
+    return 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)))
+    if (entry->d_name[0] != '.')
+      count++;
+  closedir(dir);
+  return count;
+}
+
+static size_t spawned(thread_pool_t *pool) {
+  return __atomic_load_n(&pool->spawned, __ATOMIC_SEQ_CST);
+}
+
+static void block(void *arg __attribute__((unused)),
+                  size_t argsz __attribute__((unused))) {
+  sem_post(&started);
+  while (sem_wait(&release) != 0);
+}
+
+static void wait_idle(thread_pool_t *pool) {
+  for (size_t i = 0; i < spawned(pool); ++i)
+    while (!__atomic_load_n(&pool->workers[i].idle, __ATOMIC_SEQ_CST))
+      usleep(1000);
+}
+
+static char *test_no_threads_at_startup() {
+  mu_assert("threads started before any task", threads() == 1);
+  return 0;
+}
+
+static char *test_spawned_on_demand() {
+  thread_pool_t pool;
+  sem_init(&started, 0, 0);
+  sem_init(&release, 0, 0);
+  mu_assert("init failed", thread_pool_init(&pool, 4) == 0);
+  mu_assert("workers spawned by init", spawned(&pool) == 0);
+
+  // an idle worker takes the next task
+  for (int i = 0; i < 10; ++i) {
+    defer(&pool, (runnable_t){.function = block});
+    while (sem_wait(&started) != 0);
+    sem_post(&release);
+    wait_idle(&pool);
+  }
+  mu_assert("spawned with an idle worker", spawned(&pool) == 1);
+
+  for (int i = 0; i < 3; ++i) {
+    defer(&pool, (runnable_t){.function = block});
+    while (sem_wait(&started) != 0);
+  }
+  mu_assert("not spawned for busy workers", spawned(&pool) == 3);
+
+  for (int i = 0; i < 3; ++i)
+    defer(&pool, (runnable_t){.function = block});
+  mu_assert("more workers than pool_size", spawned(&pool) == 4);
+  for (int i = 0; i < 6; ++i)
+    sem_post(&release);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&started);
+  sem_destroy(&release);
+  return 0;
+}
+
+static void *twice(void *arg, size_t argsz __attribute__((unused)), size_t *retsz) {
+  int *result = malloc(sizeof(int));
+  *result = 2 * *(int *)arg;
+  *retsz = sizeof(int);
+  return result;
+}
+
+static void post(void *arg, size_t argsz __attribute__((unused))) {
+  sem_post(arg);
+}
+
+static char *test_default_pool() {
+  thread_pool_t *pool = thread_pool_default();
+  mu_assert("no default pool", pool != NULL);
+  mu_assert("default pool changed", thread_pool_default() == pool);
+  mu_assert("not one worker per CPU",
+            pool->pool_size == (size_t)sysconf(_SC_NPROCESSORS_ONLN));
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  mu_assert("defer failed", defer(NULL, (runnable_t){.function = post, .arg = &done}) == 0);
+  while (sem_wait(&done) != 0);
+  sem_destroy(&done);
+  mu_assert("task not run by the default pool", spawned(pool) >= 1);
+
+  future_t future;
+  int value = 21;
+  mu_assert("async failed", async(NULL, &future, (callable_t){twice, &value, sizeof(value)}) == 0);
+  int *result = await(&future);
+  mu_assert("wrong result", *result == 42);
+  free(result);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_no_threads_at_startup);
+  mu_run_test(test_spawned_on_demand);
+  mu_run_test(test_default_pool);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
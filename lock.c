@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "lock.h"
+
+// Names in parentheses are not expanded by the profiling macros of lock.h.
+
+static int _mutexattr_init(pthread_mutexattr_t *attr) {
+    int err;
+    if ((err = pthread_mutexattr_init(attr)))
+        return err;
+#ifndef ASYNC_PLAIN_MUTEX
+    if ((err = pthread_mutexattr_settype(attr, PTHREAD_MUTEX_ERRORCHECK))) {
+        pthread_mutexattr_destroy(attr);
+        return err;
+    }
+    if ((err = pthread_mutexattr_setrobust(attr, PTHREAD_MUTEX_ROBUST))) {
+        pthread_mutexattr_destroy(attr);
+        return err;
+    }
+#endif
+    return OK;
+}
+
+int _mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
+    int err;
+    if ((err = _mutexattr_init(attr)))
+        return err;
+    if ((err = pthread_mutex_init(mutex, attr))) {
+        pthread_mutexattr_destroy(attr);
+        return err;
+    }
+    return OK;
+}
+
+void _mutex_destroy(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
+    pthread_mutex_destroy(mutex);
+    pthread_mutexattr_destroy(attr);
+}
+
+int (robust_mutex_lock)(pthread_mutex_t * mutex) {
+    int err = 0;
+    switch((err = pthread_mutex_lock(mutex))) {
+      case EOWNERDEAD:
+        return pthread_mutex_consistent(mutex);
+      case 0:
+        return 0;
+      default:
+        return err;
+    }
+}
+
+#ifdef ASYNC_LOCK_PROFILE
+
+#define MAX_HELD (16)
+
+// locks held by the calling thread, to time how long they are held
+static __thread struct {
+    pthread_mutex_t *mutex;
+    lock_site_t *site;
+    unsigned long long since;
+} held[MAX_HELD];
+static __thread int held_count;
+
+static lock_site_t *sites;
+
+static unsigned long long lock_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void update_max(unsigned long long *max, unsigned long long value) {
+    unsigned long long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void register_site(lock_site_t *site) {
+    if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL))
+        return;
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sites, &site->next, site, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void held_push(pthread_mutex_t *mutex, lock_site_t *site) {
+    if (held_count == MAX_HELD)
+        return;
+    held[held_count].mutex = mutex;
+    held[held_count].site = site;
+    held[held_count].since = lock_clock();
+    held_count++;
+}
+
+// Returns the entry of the mutex, taken off the list of held locks.
+static int held_pop(pthread_mutex_t *mutex, lock_site_t **site, unsigned long long *since) {
+    for (int i = held_count - 1; i >= 0; --i) {
+        if (held[i].mutex != mutex)
+            continue;
+        *site = held[i].site;
+        *since = held[i].since;
+        for (; i + 1 < held_count; ++i)
+            held[i] = held[i + 1];
+        held_count--;
+        return 1;
+    }
+    return 0;
+}
+
+int robust_mutex_lock_at(pthread_mutex_t *mutex, lock_site_t *site) {
+    register_site(site);
+    int err = pthread_mutex_trylock(mutex);
+    if (err == EBUSY) {
+        unsigned long long start = lock_clock();
+        err = pthread_mutex_lock(mutex);
+        unsigned long long waited = lock_clock() - start;
+        __atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&site->wait_ns, waited, __ATOMIC_RELAXED);
+        update_max(&site->max_wait_ns, waited);
+    }
+    if (err == EOWNERDEAD)
+        err = pthread_mutex_consistent(mutex);
+    if (err)
+        return err;
+    __atomic_add_fetch(&site->acquisitions, 1, __ATOMIC_RELAXED);
+    held_push(mutex, site);
+    return OK;
+}
+
+int lock_profile_unlock(pthread_mutex_t *mutex) {
+    lock_site_t *site;
+    unsigned long long since;
+    if (held_pop(mutex, &site, &since)) {
+        unsigned long long hold = lock_clock() - since;
+        __atomic_add_fetch(&site->hold_ns, hold, __ATOMIC_RELAXED);
+        update_max(&site->max_hold_ns, hold);
+    }
+    return (pthread_mutex_unlock)(mutex);
+}
+
+// The lock is not held while waiting on the condition.
+int lock_profile_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    lock_site_t *site;
+    unsigned long long since;
+    int held_before = held_pop(mutex, &site, &since);
+    if (held_before) {
+        unsigned long long hold = lock_clock() - since;
+        __atomic_add_fetch(&site->hold_ns, hold, __ATOMIC_RELAXED);
+        update_max(&site->max_hold_ns, hold);
+    }
+    int err = (pthread_cond_wait)(cond, mutex);
+    if (held_before)
+        held_push(mutex, site);
+    return err;
+}
+
+static int by_wait(const void *a, const void *b) {
+    const lock_site_t *x = *(lock_site_t * const *)a, *y = *(lock_site_t * const *)b;
+    if (x->wait_ns != y->wait_ns)
+        return x->wait_ns < y->wait_ns ? 1 : -1;
+    return x->acquisitions < y->acquisitions ? 1 : x->acquisitions > y->acquisitions ? -1 : 0;
+}
+
+void lock_profile_dump(FILE *out) {
+    size_t count = 0;
+    for (lock_site_t *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); site; site = site->next)
+        count++;
+    lock_site_t **sorted = malloc(count * sizeof(*sorted) + 1);
+    if (sorted == NULL)
+        return;
+    count = 0;
+    for (lock_site_t *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); site; site = site->next)
+        sorted[count++] = site;
+    qsort(sorted, count, sizeof(*sorted), by_wait);
+
+    fprintf(out, "%-28s %-18s %10s %10s %12s %10s %12s %10s\n", "function", "location",
+            "acquired", "contended", "wait us", "max wait", "hold us", "max hold");
+    for (size_t i = 0; i < count; ++i) {
+        lock_site_t *site = sorted[i];
+        const char *location = site->location;
+        for (const char *p = location; *p; ++p)
+            if (*p == '/')
+                location = p + 1;
+        fprintf(out, "%-28s %-18s %10lu %10lu %12llu %10llu %12llu %10llu\n",
+                site->function, location,
+                __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED) / 1000,
+                __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED) / 1000,
+                __atomic_load_n(&site->hold_ns, __ATOMIC_RELAXED) / 1000,
+                __atomic_load_n(&site->max_hold_ns, __ATOMIC_RELAXED) / 1000);
+    }
+    free(sorted);
+}
+
+void lock_profile_reset(void) {
+    for (lock_site_t *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+        __atomic_store_n(&site->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->max_wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->max_hold_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+__attribute__((destructor)) static void lock_profile_at_exit() {
+    if (__atomic_load_n(&sites, __ATOMIC_ACQUIRE))
+        lock_profile_dump(stderr);
+}
+
+#else
+
+void lock_profile_dump(__attribute__((unused)) FILE *out) {}
+
+void lock_profile_reset(void) {}
+
+#endif
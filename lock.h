@@ -0,0 +1,55 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Mutexes of the library are error-checking and robust. Built with
+// ASYNC_PLAIN_MUTEX they are default mutexes instead, to measure what the
+// checks cost.
+int _mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
+void _mutex_destroy(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
+
+// Locks the mutex, making it consistent again if its owner died.
+int robust_mutex_lock(pthread_mutex_t *mutex);
+
+// Statistics of one place in the code which takes a lock. Times are in
+// nanoseconds; waits are measured only for contended acquisitions.
+typedef struct lock_site {
+    const char *function;
+    const char *location;
+    struct lock_site *next;
+    int registered;
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+} lock_site_t;
+
+// Prints the statistics of every site which took a lock, most waited on
+// first. Built with ASYNC_LOCK_PROFILE the report is also printed to stderr
+// at exit; otherwise there is nothing to report.
+void lock_profile_dump(FILE *out);
+
+void lock_profile_reset(void);
+
+#ifdef ASYNC_LOCK_PROFILE
+int robust_mutex_lock_at(pthread_mutex_t *mutex, lock_site_t *site);
+int lock_profile_unlock(pthread_mutex_t *mutex);
+int lock_profile_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+#define LOCK_SITE_STR_(line) #line
+#define LOCK_SITE_STR(line) LOCK_SITE_STR_(line)
+
+// Every call site gets its own statistics.
+#define robust_mutex_lock(mutex) ({ \
+    static lock_site_t lock_site_ = {.function = __func__, \
+                                     .location = __FILE__ ":" LOCK_SITE_STR(__LINE__)}; \
+    robust_mutex_lock_at((mutex), &lock_site_); })
+#define pthread_mutex_unlock(mutex) lock_profile_unlock(mutex)
+#define pthread_cond_wait(cond, mutex) lock_profile_cond_wait((cond), (mutex))
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lock.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define ROUNDS 100
+#define HOLD_US 20000
+
+static pthread_mutex_t mutex;
+static pthread_mutexattr_t attr;
+static lock_site_t site = {.function = "contend", .location = __FILE__ ":0"};
+
+static void *contend(void *arg __attribute__((unused))) {
+  robust_mutex_lock_at(&mutex, &site);
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static char *test_mutex_kind() {
+  int type, robust;
+  pthread_mutexattr_gettype(&attr, &type);
+  pthread_mutexattr_getrobust(&attr, &robust);
+#ifdef ASYNC_PLAIN_MUTEX
+  mu_assert("plain mutex checks errors", type == PTHREAD_MUTEX_DEFAULT);
+  mu_assert("plain mutex is robust", robust == PTHREAD_MUTEX_STALLED);
+#else
+  mu_assert("mutex does not check errors", type == PTHREAD_MUTEX_ERRORCHECK);
+  mu_assert("mutex is not robust", robust == PTHREAD_MUTEX_ROBUST);
+#endif
+  return 0;
+}
+
+static char *test_contended_counts() {
+  pthread_t thread;
+  for (int i = 0; i < ROUNDS; ++i) {
+    mu_assert("lock failed", robust_mutex_lock_at(&mutex, &site) == 0);
+    pthread_mutex_unlock(&mutex);
+  }
+  mu_assert("uncontended acquisitions counted as waits", site.contended == 0);
+
+  // the thread finds the mutex taken and waits for it
+  robust_mutex_lock_at(&mutex, &site);
+  pthread_create(&thread, NULL, contend, NULL);
+  usleep(HOLD_US);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+
+  mu_assert("acquisitions miscounted", site.acquisitions == ROUNDS + 2);
+  mu_assert("contended acquisition not counted", site.contended == 1);
+  mu_assert("wait not measured", site.wait_ns >= HOLD_US * 1000ull / 2);
+  mu_assert("max wait not the only wait", site.max_wait_ns == site.wait_ns);
+  mu_assert("hold not measured", site.max_hold_ns >= HOLD_US * 1000ull / 2);
+
+  lock_profile_reset();
+  mu_assert("reset left acquisitions", site.acquisitions == 0 && site.wait_ns == 0);
+  return 0;
+}
+
+static char *test_call_site_dumped() {
+  char *report;
+  size_t size;
+  FILE *out = open_memstream(&report, &size);
+  robust_mutex_lock(&mutex);
+  pthread_mutex_unlock(&mutex);
+  lock_profile_dump(out);
+  fclose(out);
+
+  mu_assert("call site of robust_mutex_lock not reported",
+            strstr(report, "test_call_site_dumped") != NULL);
+  mu_assert("explicit site not reported", strstr(report, "contend") != NULL);
+  free(report);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_mutex_kind);
+  mu_run_test(test_contended_counts);
+  mu_run_test(test_call_site_dumped);
+  return 0;
+}
+
+int main() {
+  _mutex_init(&mutex, &attr);
+  char *result = all_tests();
+  _mutex_destroy(&mutex, &attr);
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
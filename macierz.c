@@ -1,15 +1,31 @@
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "threadpool.h"
+#include "group.h"
+
+#define POOL_SIZE (4)
+// chunks of input parsed in parallel, per worker
+#define CHUNKS_PER_WORKER (4)
+#define READ_BLOCK (1 << 20)
 
 typedef struct {
     int64_t value;
     int64_t delay;
-    sem_t* sem;
     int64_t* ptr;
 } value_delay;
 
@@ -24,72 +40,348 @@ void wait_then_ret_val(void* data, __attribute__((unused)) size_t sz) {
         errno = 0;
         nanosleep(&t, &t);
     } while (errno == EINTR);
-    *ptr->ptr = ptr->value;
-    if (sem_post(ptr->sem)) {
+    __atomic_fetch_add(ptr->ptr, ptr->value, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+// Cells without delay are stored in place, row by row, and summed in bulk.
+// Delayed cells keep a task each, in the group of their row, and add
+// themselves to late[i] when done; their slot in values stays 0.
+struct matrix {
+    size_t k, n;
+    int64_t* values;
+    int64_t* late;
+    task_group_t* rows;
+    int64_t* sums;
+    thread_pool_t* pool;
+};
+
+// Consecutive rows summed by one task.
+struct band {
+    size_t first, last;
+    struct matrix* matrix;
+    sem_t ready;
+};
+
+// Part of the input starting and ending at whitespace, so that no number is
+// cut in two.
+struct chunk {
+    const char *begin, *end, *input_end;
+    size_t tokens;
+    // index of the first token of the chunk in the whole input
+    size_t first_token;
+    struct matrix* matrix;
+    sem_t* done;
+};
+
+static int is_space(char c) {
+    return (unsigned char)c <= ' ';
+}
+
+// Whole standard input, mapped when it is a file and read in large blocks
+// otherwise.
+static char* read_input(size_t* size, int* mapped) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char* input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (input != MAP_FAILED) {
+            madvise(input, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+            *mapped = 1;
+            return input;
+        }
+    }
+
+    size_t capacity = READ_BLOCK, len = 0;
+    char* input = malloc(capacity);
+    while (input) {
+        if (capacity - len < READ_BLOCK) {
+            char* bigger = realloc(input, 2 * capacity);
+            if (bigger == NULL)
+                break;
+            input = bigger;
+            capacity *= 2;
+        }
+        ssize_t got = read(STDIN_FILENO, input + len, capacity - len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            break;
+        if (got == 0) {
+            *size = len;
+            *mapped = 0;
+            return input;
+        }
+        len += got;
+    }
+    free(input);
+    return NULL;
+}
+
+// Parses a number starting at *p, leaves *p right after it.
+static int64_t parse_int(const char** p, const char* end) {
+    const char* s = *p;
+    int negative = 0;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+    uint64_t v = 0;
+    while (s < end && (unsigned)(*s - '0') < 10)
+        v = v * 10 + (*s++ - '0');
+    *p = s;
+    return negative ? -(int64_t)v : (int64_t)v;
+}
+
+static const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && is_space(*p))
+        ++p;
+    return p;
+}
+
+static const char* skip_token(const char* p, const char* end) {
+    while (p < end && !is_space(*p))
+        ++p;
+    return p;
+}
+
+// Number of places where a token starts, i.e. a non-space follows a space.
+// begin has to point at a space.
+static size_t count_tokens(const char* begin, const char* end) {
+    size_t tokens = 0;
+    const char* p = begin;
+    int prev_space = 1;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    unsigned carry = 1;
+    for (; p + 16 <= end; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        // bytes above ' ' (signed, so non-ASCII bytes count as spaces)
+        unsigned token = _mm_movemask_epi8(_mm_cmpgt_epi8(bytes, space));
+        unsigned spaces_before = ~((token << 1) | (carry ^ 1)) & 0xffff;
+        tokens += __builtin_popcount(token & spaces_before);
+        carry = !(token >> 15);
+    }
+    prev_space = carry;
+#endif
+    for (; p < end; ++p) {
+        int space = is_space(*p) || (signed char)*p < 0;
+        tokens += prev_space && !space;
+        prev_space = space;
+    }
+    return tokens;
+}
+
+static void count_chunk(void* arg, __attribute__((unused)) size_t argsz) {
+    struct chunk* c = arg;
+    c->tokens = count_tokens(c->begin, c->end);
+    if (sem_post(c->done))
         exit(1);
+}
+
+static void dispatch_cell(struct matrix* m, size_t cell, int64_t value, int64_t delay) {
+    size_t i = cell / m->n;
+    if (delay == 0) {
+        m->values[cell] = value;
+        return;
     }
+    m->values[cell] = 0;
+    value_delay* vd = malloc(sizeof (*vd));
+    if (vd == NULL)
+        exit(1);
+    vd->value = value;
+    vd->delay = delay;
+    vd->ptr = &m->late[i];
+    runnable_t runnable;
+    runnable.arg = vd;
+    runnable.argsz = sizeof (*vd);
+    runnable.function = wait_then_ret_val;
+    if (task_group_defer(&m->rows[i], m->pool, runnable))
+        exit(1);
+}
+
+// Every cell whose value starts in the chunk is handed to the pool right
+// away; its delay may lie past the end of the chunk.
+static void parse_chunk(void* arg, __attribute__((unused)) size_t argsz) {
+    struct chunk* c = arg;
+    struct matrix* m = c->matrix;
+    size_t cells = m->k * m->n;
+    size_t token = c->first_token;
+    const char* p = skip_spaces(c->begin, c->end);
+
+    if (token % 2 && p < c->end) {
+        p = skip_spaces(skip_token(p, c->end), c->end);
+        token++;
+    }
+    while (p < c->end && token / 2 < cells) {
+        int64_t value = parse_int(&p, c->input_end);
+        p = skip_spaces(p, c->input_end);
+        int64_t delay = parse_int(&p, c->input_end);
+        dispatch_cell(m, token / 2, value, delay);
+        token += 2;
+        p = skip_spaces(p, c->end);
+    }
+    if (sem_post(c->done))
+        exit(1);
+}
+
+// Sums wrap around on overflow instead of being undefined.
+static int64_t sum_row_scalar(const int64_t* row, size_t n) {
+    uint64_t sum = 0;
+    for (size_t j = 0; j < n; ++j)
+        sum += row[j];
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int64_t sum_row_avx2(const int64_t* row, size_t n) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256((const __m256i*)(row + j)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256((const __m256i*)(row + j + 4)));
+        acc2 = _mm256_add_epi64(acc2, _mm256_loadu_si256((const __m256i*)(row + j + 8)));
+        acc3 = _mm256_add_epi64(acc3, _mm256_loadu_si256((const __m256i*)(row + j + 12)));
+    }
+    acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc0);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + (uint64_t)sum_row_scalar(row + j, n - j);
+}
+#endif
+
+static int64_t (*sum_row)(const int64_t*, size_t) = sum_row_scalar;
+
+static void pick_sum_row(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        sum_row = sum_row_avx2;
+#endif
+}
+
+static void sum_band(void* arg, __attribute__((unused)) size_t argsz) {
+    struct band* b = arg;
+    struct matrix* m = b->matrix;
+    for (size_t i = b->first; i < b->last; ++i)
+        m->sums[i] = sum_row(m->values + i * m->n, m->n);
+    if (sem_post(&b->ready))
+        exit(1);
 }
 
 int main() {
     struct thread_pool pool;
-    if (thread_pool_init(&pool, 4)) {
+    if (thread_pool_init(&pool, POOL_SIZE)) {
         return EXIT_FAILURE;
     }
-    size_t k, n;
-    if (2 != scanf("%zu%zu", &k, &n))
+    pick_sum_row();
+    size_t input_size;
+    int mapped;
+    char* input = read_input(&input_size, &mapped);
+    if (input == NULL)
         return EXIT_FAILURE;
+    const char* input_end = input + input_size;
+
+    const char* p = skip_spaces(input, input_end);
+    size_t k = parse_int(&p, input_end);
+    p = skip_spaces(p, input_end);
+    size_t n = parse_int(&p, input_end);
 
-    int64_t** tab;
-    tab = calloc(k, sizeof (*tab));
-    value_delay **vd_row = calloc(k, sizeof (value_delay*));
-    sem_t* sems = calloc(k, sizeof (sem_t));
-    if (vd_row == NULL || sems == NULL || tab == NULL)
+    struct matrix matrix = {.k = k, .n = n, .pool = &pool};
+    matrix.values = malloc(k * n * sizeof (*matrix.values) + 1);
+    matrix.late = calloc(k, sizeof (*matrix.late));
+    matrix.rows = calloc(k, sizeof (*matrix.rows));
+    matrix.sums = calloc(k, sizeof (*matrix.sums));
+    if (matrix.values == NULL || matrix.late == NULL || matrix.rows == NULL
+        || matrix.sums == NULL)
         return EXIT_FAILURE;
     for (size_t i = 0; i < k; ++i) {
-        if (sem_init(sems + i, 0, 0)) {
-            return EXIT_FAILURE;
-        }
-        tab[i] = calloc(n, sizeof (**tab));
-        vd_row[i] = calloc(n, sizeof (**vd_row));
-        if (tab[i] == NULL || vd_row[i] == NULL) {
+        if (task_group_init(matrix.rows + i)) {
             return EXIT_FAILURE;
         }
     }
 
-    for (int i = 0; i < (int)k; ++i) {
-        for (int j = 0; j < (int)n; ++j) {
-            scanf("%ld%ld", &vd_row[i][j].value, &vd_row[i][j].delay);
-            vd_row[i][j].ptr = &tab[i][j];
-            vd_row[i][j].sem = sems + i;
-            runnable_t runnable;
-            runnable.arg = &vd_row[i][j];
-            runnable.argsz = sizeof (vd_row);
-            runnable.function = wait_then_ret_val;
-            defer(&pool, runnable);
-        }
+    // count numbers in every chunk first, to know where each chunk starts
+    size_t nchunks = POOL_SIZE * CHUNKS_PER_WORKER;
+    struct chunk* chunks = calloc(nchunks, sizeof (*chunks));
+    sem_t counted;
+    if (chunks == NULL || sem_init(&counted, 0, 0))
+        return EXIT_FAILURE;
+    const char* begin = p;
+    size_t rest = input_end - p;
+    for (size_t c = 0; c < nchunks; ++c) {
+        const char* end = c + 1 == nchunks ? input_end : p + rest * (c + 1) / nchunks;
+        if (end < begin)
+            end = begin;
+        end = skip_token(end, input_end);
+        chunks[c] = (struct chunk){.begin = begin, .end = end, .input_end = input_end,
+                                   .matrix = &matrix, .done = &counted};
+        begin = end;
+        runnable_t runnable = {.function = count_chunk, .arg = chunks + c,
+                               .argsz = sizeof (*chunks)};
+        if (defer(&pool, runnable))
+            return EXIT_FAILURE;
+    }
+    for (size_t c = 0; c < nchunks; ++c) {
+        while (sem_wait(&counted) != 0 && errno == EINTR);
+    }
+    size_t tokens = 0;
+    for (size_t c = 0; c < nchunks; ++c) {
+        chunks[c].first_token = tokens;
+        tokens += chunks[c].tokens;
     }
+    if (tokens < 2 * k * n)
+        return EXIT_FAILURE;
 
-    for (size_t i = 0; i < k; ++i) {
-        int sum = 0;
-        for (size_t j = 0; j < n; ++j) {
-            while (sem_wait(sems + i) != 0 || errno == EINTR);
-        }
-        for (size_t j = 0; j < n; ++j) {
-            sum += tab[i][j];
-        }
-        printf("%d\n", sum);
+    for (size_t c = 0; c < nchunks; ++c) {
+        runnable_t runnable = {.function = parse_chunk, .arg = chunks + c,
+                               .argsz = sizeof (*chunks)};
+        if (defer(&pool, runnable))
+            return EXIT_FAILURE;
+    }
+    for (size_t c = 0; c < nchunks; ++c) {
+        while (sem_wait(&counted) != 0 && errno == EINTR);
     }
 
-    for (size_t i = 0; i < k; ++i) {
-        free(tab[i]);
-        if (sem_destroy(sems + i)) {
+    // rows are summed in bands while delayed cells are still sleeping
+    size_t nbands = k < nchunks ? k : nchunks;
+    struct band* bands = calloc(nbands, sizeof (*bands));
+    if (nbands && bands == NULL)
+        return EXIT_FAILURE;
+    for (size_t b = 0; b < nbands; ++b) {
+        bands[b].first = k * b / nbands;
+        bands[b].last = k * (b + 1) / nbands;
+        bands[b].matrix = &matrix;
+        if (sem_init(&bands[b].ready, 0, 0))
             return EXIT_FAILURE;
+        runnable_t runnable = {.function = sum_band, .arg = bands + b,
+                               .argsz = sizeof (*bands)};
+        if (defer(&pool, runnable))
+            return EXIT_FAILURE;
+    }
+
+    for (size_t b = 0; b < nbands; ++b) {
+        while (sem_wait(&bands[b].ready) != 0 && errno == EINTR);
+        for (size_t i = bands[b].first; i < bands[b].last; ++i) {
+            task_group_wait(matrix.rows + i);
+            int64_t late = __atomic_load_n(&matrix.late[i], __ATOMIC_RELAXED);
+            printf("%" PRId64 "\n", (int64_t)((uint64_t)matrix.sums[i] + late));
         }
-        free(vd_row[i]);
+        sem_destroy(&bands[b].ready);
     }
-    free(sems);
-    free(tab);
-    free(vd_row);
+
     thread_pool_destroy(&pool);
+    sem_destroy(&counted);
+    free(chunks);
+    free(bands);
+    for (size_t i = 0; i < k; ++i)
+        task_group_destroy(matrix.rows + i);
+    free(matrix.rows);
+    free(matrix.values);
+    free(matrix.late);
+    free(matrix.sums);
+    if (mapped)
+        munmap(input, input_size);
+    else
+        free(input);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,171 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+// Chains of functions run on a pool with as few dispatches as possible:
+//
+//     auto r = asyncc::source(pool, f) | asyncc::then(g) | asyncc::then(h);
+//
+// Stages added with then are composed at compile time with the ones before
+// them into a single task body, so the chain above is one task. A new
+// dispatch (a map on the future computed so far) starts only at a stage
+// added with heavy, which then begins the next fused run of stages, or after
+// an explicit asyncc::boundary. A future can be continued the same way;
+// its stages then run as one map.
+//
+// Nothing before the first boundary runs until the pipeline is started with
+// start() or get(), or converted to a future.
+
+#include <type_traits>
+#include <utility>
+
+#include "async.hpp"
+
+namespace asyncc {
+
+namespace detail {
+
+struct no_stages {};
+
+template <class F, class G>
+struct composed {
+    F f;
+    G g;
+
+    template <class... A>
+    decltype(auto) operator()(A &&...args) {
+        if constexpr (std::is_void_v<std::invoke_result_t<F &, A...>>) {
+            f(std::forward<A>(args)...);
+            return g();
+        } else {
+            return g(f(std::forward<A>(args)...));
+        }
+    }
+};
+
+template <class F, class G>
+auto compose(F &&f, G &&g) {
+    if constexpr (std::is_same_v<std::decay_t<F>, no_stages>)
+        return std::forward<G>(g);
+    else if constexpr (std::is_same_v<std::decay_t<G>, no_stages>)
+        return std::forward<F>(f);
+    else
+        return composed<std::decay_t<F>, std::decay_t<G>>{std::forward<F>(f),
+                                                           std::forward<G>(g)};
+}
+
+template <class F>
+struct fused_stage {
+    F f;
+};
+
+template <class F>
+struct heavy_stage {
+    F f;
+};
+
+struct boundary_stage {};
+
+template <class>
+struct is_stage : std::false_type {};
+template <class F>
+struct is_stage<fused_stage<F>> : std::true_type {};
+template <class F>
+struct is_stage<heavy_stage<F>> : std::true_type {};
+template <>
+struct is_stage<boundary_stage> : std::true_type {};
+
+// First stage of a pipeline, not dispatched yet.
+template <class F>
+struct lazy_source {
+    thread_pool_t *pool;
+    F f;
+};
+
+} // namespace detail
+
+// Stage fused with the ones before it.
+template <class F>
+auto then(F &&f) {
+    return detail::fused_stage<std::decay_t<F>>{std::forward<F>(f)};
+}
+
+// Stage expensive enough to deserve its own dispatch.
+template <class F>
+auto heavy(F &&f) {
+    return detail::heavy_stage<std::decay_t<F>>{std::forward<F>(f)};
+}
+
+inline constexpr detail::boundary_stage boundary{};
+
+template <class Head, class Body>
+class pipeline {
+  public:
+    pipeline(Head head, Body body) : head_(std::move(head)), body_(std::move(body)) {}
+
+    // Dispatches the stages not started yet, as one task.
+    auto start() {
+        if constexpr (is_future<Head>::value) {
+            if constexpr (std::is_same_v<Body, detail::no_stages>)
+                return std::move(head_);
+            else
+                return head_.then(std::move(body_));
+        } else {
+            return async(head_.pool, detail::compose(std::move(head_.f), std::move(body_)));
+        }
+    }
+
+    auto get() { return start().get(); }
+
+    template <class T>
+    operator future<T>() && { return start(); }
+
+    template <class F>
+    auto operator|(detail::fused_stage<F> stage) && {
+        auto body = detail::compose(std::move(body_), std::move(stage.f));
+        return pipeline<Head, decltype(body)>(std::move(head_), std::move(body));
+    }
+
+    template <class F>
+    auto operator|(detail::heavy_stage<F> stage) && {
+        auto started = start();
+        return pipeline<decltype(started), F>(std::move(started), std::move(stage.f));
+    }
+
+    auto operator|(detail::boundary_stage) && {
+        auto started = start();
+        return pipeline<decltype(started), detail::no_stages>(std::move(started), {});
+    }
+
+  private:
+    template <class>
+    struct is_future : std::false_type {};
+    template <class T>
+    struct is_future<future<T>> : std::true_type {};
+
+    Head head_;
+    Body body_;
+};
+
+// Starts a pipeline with f() on the pool (nullptr: the default one).
+template <class F>
+auto source(thread_pool_t *pool, F &&f) {
+    using Head = detail::lazy_source<std::decay_t<F>>;
+    return pipeline<Head, detail::no_stages>(Head{pool, std::forward<F>(f)}, {});
+}
+
+template <class F>
+auto source(pool &p, F &&f) {
+    return source(p.native(), std::forward<F>(f));
+}
+
+// Only stages are taken, so that | on futures means nothing else.
+template <class T, class Stage,
+          std::enable_if_t<detail::is_stage<std::decay_t<Stage>>::value, int> = 0>
+auto operator|(future<T> &&started, Stage &&stage) {
+    return pipeline<future<T>, detail::no_stages>(std::move(started), {})
+           | std::forward<Stage>(stage);
+}
+
+} // namespace asyncc
+
+#endif
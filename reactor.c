@@ -0,0 +1,593 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifdef ASYNC_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "reactor.h"
+#include "lock.h"
+
+extern int future_init(future_t *);
+extern void future_complete(future_t *, void *);
+
+#define REACTOR_EVENTS (64)
+#define RING_ENTRIES (256)
+
+enum io_op { IO_READ, IO_WRITE, IO_POLL };
+
+struct io_request {
+    future_t *future;
+    struct reactor *reactor;
+    int fd;
+    enum io_op op;
+    short events;
+    void *buf;
+    size_t count;
+    struct io_request *prev, *next;
+};
+
+// Requests waiting for readiness of one descriptor.
+struct fd_waiters {
+    struct io_request *head, *tail;
+};
+
+#ifdef ASYNC_IO_URING
+// user_data of the request which tells the ring loop to finish
+static char ring_stop_marker;
+
+struct ring {
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct reactor {
+    thread_pool_t *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_mutexattr_t lock_attr;
+    int epfd;
+    int wakefd;
+    struct fd_waiters *fds;
+    size_t fds_size;
+    short stopped;
+#ifdef ASYNC_IO_URING
+    int use_ring;
+    struct ring ring;
+    // submitted to the ring and not completed yet
+    struct io_request *in_flight;
+#endif
+};
+
+static void io_complete(struct io_request *req, ssize_t value) {
+    future_t *future = req->future;
+    void *result = future->inline_result;
+    if (req->op == IO_POLL) {
+        *(int *)result = value;
+        future->result_size = sizeof(int);
+    } else {
+        *(ssize_t *)result = value;
+        future->result_size = sizeof(ssize_t);
+    }
+    free(req);
+    future_complete(future, result);
+}
+
+static int epoll_submit(struct reactor *reactor, struct io_request *req);
+
+// Runs on the pool once the descriptor is ready, or right away for files.
+static void io_run(void *arg, __attribute__((unused)) size_t argsz) {
+    struct io_request *req = arg;
+    ssize_t ret = req->op == IO_READ ? read(req->fd, req->buf, req->count)
+                                     : write(req->fd, req->buf, req->count);
+    int err = errno;
+    if (ret < 0 && (err == EAGAIN || err == EWOULDBLOCK)) {
+        if (epoll_submit(req->reactor, req) == OK)
+            return;
+        err = errno;
+    }
+    io_complete(req, ret < 0 ? -err : ret);
+}
+
+static int io_defer(struct io_request *req) {
+    runnable_t runnable = {.function = io_run, .arg = req, .argsz = sizeof(*req)};
+    return defer(req->reactor->pool, runnable);
+}
+
+static short waiter_events(struct fd_waiters *waiters) {
+    short events = 0;
+    for (struct io_request *req = waiters->head; req; req = req->next)
+        events |= req->events;
+    return events;
+}
+
+static void waiters_remove(struct fd_waiters *waiters, struct io_request *req) {
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        waiters->head = req->next;
+    if (req->next)
+        req->next->prev = req->prev;
+    else
+        waiters->tail = req->prev;
+    req->prev = req->next = NULL;
+}
+
+static int epoll_arm(struct reactor *reactor, int fd, short events, int add) {
+    struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.fd = fd};
+    int err = epoll_ctl(reactor->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+    // the descriptor may have been closed and reopened in the meantime
+    if (err && errno == (add ? EEXIST : ENOENT))
+        err = epoll_ctl(reactor->epfd, add ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+    return err;
+}
+
+static int fds_reserve(struct reactor *reactor, int fd) {
+    if ((size_t)fd < reactor->fds_size)
+        return OK;
+    size_t size = reactor->fds_size ? reactor->fds_size : 64;
+    while (size <= (size_t)fd)
+        size *= 2;
+    struct fd_waiters *fds = realloc(reactor->fds, size * sizeof(*fds));
+    if (fds == NULL)
+        return ERR;
+    memset(fds + reactor->fds_size, 0, (size - reactor->fds_size) * sizeof(*fds));
+    reactor->fds = fds;
+    reactor->fds_size = size;
+    return OK;
+}
+
+static int epoll_submit(struct reactor *reactor, struct io_request *req) {
+    FE(robust_mutex_lock(&reactor->lock));
+    if (reactor->stopped) {
+        pthread_mutex_unlock(&reactor->lock);
+        errno = ECANCELED;
+        return ERR;
+    }
+    if (fds_reserve(reactor, req->fd)) {
+        pthread_mutex_unlock(&reactor->lock);
+        errno = ENOMEM;
+        return ERR;
+    }
+    struct fd_waiters *waiters = &reactor->fds[req->fd];
+    int first = waiters->head == NULL;
+    short events = waiter_events(waiters) | req->events;
+    if (epoll_arm(reactor, req->fd, events, first)) {
+        int err = errno;
+        pthread_mutex_unlock(&reactor->lock);
+        // epoll refuses regular files, which are always ready
+        if (err == EPERM && req->op != IO_POLL)
+            return io_defer(req);
+        if (err == EPERM) {
+            io_complete(req, req->events & (POLLIN | POLLOUT));
+            return OK;
+        }
+        errno = err;
+        return ERR;
+    }
+    req->prev = waiters->tail;
+    req->next = NULL;
+    if (waiters->tail)
+        waiters->tail->next = req;
+    else
+        waiters->head = req;
+    waiters->tail = req;
+    pthread_mutex_unlock(&reactor->lock);
+    return OK;
+}
+
+// Hands the descriptor to the first waiting read, the first waiting write and
+// every poll whose events occurred; the rest wait for the next event.
+static void epoll_dispatch(struct reactor *reactor, int fd, unsigned revents) {
+    struct io_request *ready = NULL;
+    FE(robust_mutex_lock(&reactor->lock));
+    struct fd_waiters *waiters = &reactor->fds[fd];
+    short all = EPOLLERR | EPOLLHUP;
+    int read_taken = 0, write_taken = 0;
+    for (struct io_request *req = waiters->head, *next; req; req = next) {
+        next = req->next;
+        if (!(revents & (req->events | all)))
+            continue;
+        if ((req->op == IO_READ && read_taken++) || (req->op == IO_WRITE && write_taken++))
+            continue;
+        waiters_remove(waiters, req);
+        req->next = ready;
+        ready = req;
+    }
+    int err = 0;
+    struct io_request *failed = NULL;
+    if (waiters->head == NULL) {
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (epoll_arm(reactor, fd, waiter_events(waiters), 0)) {
+        // the descriptor was closed under the waiting requests
+        err = errno;
+        failed = waiters->head;
+        waiters->head = waiters->tail = NULL;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    for (struct io_request *req = ready, *next; req; req = next) {
+        next = req->next;
+        if (req->op == IO_POLL)
+            io_complete(req, revents & (req->events | all));
+        else
+            FE(io_defer(req));
+    }
+    for (struct io_request *req = failed, *next; req; req = next) {
+        next = req->next;
+        io_complete(req, -err);
+    }
+}
+
+static void epoll_cancel_all(struct reactor *reactor) {
+    for (size_t fd = 0; fd < reactor->fds_size; ++fd) {
+        struct fd_waiters *waiters = &reactor->fds[fd];
+        while (waiters->head) {
+            struct io_request *req = waiters->head;
+            waiters_remove(waiters, req);
+            io_complete(req, -ECANCELED);
+        }
+    }
+}
+
+static void* epoll_loop(void *arg) {
+    struct reactor *reactor = arg;
+    struct epoll_event events[REACTOR_EVENTS];
+    for (;;) {
+        int n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        FE(n < 0);
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == reactor->wakefd)
+                return NULL;
+            epoll_dispatch(reactor, events[i].data.fd, events[i].events);
+        }
+    }
+}
+
+#ifdef ASYNC_IO_URING
+static int ring_init(struct ring *ring) {
+    struct io_uring_params params = {};
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return ERR;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        goto CLOSE_RING;
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED)
+        goto UNMAP_SQ;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto UNMAP_CQ;
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return OK;
+
+UNMAP_CQ:
+    munmap(ring->cq_map, ring->cq_map_size);
+UNMAP_SQ:
+    munmap(ring->sq_map, ring->sq_map_size);
+CLOSE_RING:
+    close(ring->fd);
+    return ERR;
+}
+
+static void ring_destroy(struct ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Must hold the reactor lock. Submissions are entered one by one, so the
+// submission queue is always empty here.
+static int ring_push(struct ring *ring, struct io_uring_sqe *sqe) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    ring->sqes[index] = *sqe;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret == 1 ? OK : ERR;
+}
+
+static void ring_prepare(struct io_request *req, struct io_uring_sqe *sqe) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)req;
+    switch (req->op) {
+    case IO_READ:
+    case IO_WRITE:
+        sqe->opcode = req->op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->addr = (unsigned long long)(uintptr_t)req->buf;
+        sqe->len = req->count;
+        // current file position, like read and write
+        sqe->off = -1;
+        break;
+    case IO_POLL:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = req->events;
+        break;
+    }
+}
+
+static int ring_submit(struct reactor *reactor, struct io_request *req) {
+    struct io_uring_sqe sqe;
+    ring_prepare(req, &sqe);
+    FE(robust_mutex_lock(&reactor->lock));
+    if (reactor->stopped) {
+        pthread_mutex_unlock(&reactor->lock);
+        errno = ECANCELED;
+        return ERR;
+    }
+    int err = ring_push(&reactor->ring, &sqe);
+    if (!err) {
+        req->prev = NULL;
+        req->next = reactor->in_flight;
+        if (reactor->in_flight)
+            reactor->in_flight->prev = req;
+        reactor->in_flight = req;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    return err;
+}
+
+static void* ring_loop(void *arg) {
+    struct reactor *reactor = arg;
+    struct ring *ring = &reactor->ring;
+    int stopping = 0;
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct io_request *req = (struct io_request *)(uintptr_t)cqe->user_data;
+            if (req == (void *)&ring_stop_marker) {
+                stopping = 1;
+                continue;
+            }
+            // result of a cancellation request
+            if (req == NULL)
+                continue;
+            FE(robust_mutex_lock(&reactor->lock));
+            if (req->prev)
+                req->prev->next = req->next;
+            else
+                reactor->in_flight = req->next;
+            if (req->next)
+                req->next->prev = req->prev;
+            pthread_mutex_unlock(&reactor->lock);
+            io_complete(req, cqe->res);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        FE(robust_mutex_lock(&reactor->lock));
+        int done = stopping && reactor->in_flight == NULL;
+        pthread_mutex_unlock(&reactor->lock);
+        if (done)
+            return NULL;
+        int ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        FE(ret < 0 && errno != EINTR);
+    }
+}
+
+// Cancels everything in flight and lets the loop exit once it has seen the
+// completions.
+static void ring_stop(struct reactor *reactor) {
+    struct io_uring_sqe sqe;
+    FE(robust_mutex_lock(&reactor->lock));
+    reactor->stopped = 1;
+    for (struct io_request *req = reactor->in_flight; req; req = req->next) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.addr = (unsigned long long)(uintptr_t)req;
+        FE(ring_push(&reactor->ring, &sqe));
+    }
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    sqe.user_data = (unsigned long long)(uintptr_t)&ring_stop_marker;
+    FE(ring_push(&reactor->ring, &sqe));
+    pthread_mutex_unlock(&reactor->lock);
+}
+#endif
+
+static int reactor_submit(struct reactor *reactor, struct io_request *req) {
+#ifdef ASYNC_IO_URING
+    if (reactor->use_ring)
+        return ring_submit(reactor, req);
+#endif
+    return epoll_submit(reactor, req);
+}
+
+static int reactor_init(struct reactor *reactor, thread_pool_t *pool) {
+    void *(*loop)(void *) = epoll_loop;
+    reactor->pool = pool;
+    reactor->fds = NULL;
+    reactor->fds_size = 0;
+    reactor->stopped = 0;
+    reactor->epfd = reactor->wakefd = -1;
+    if (_mutex_init(&reactor->lock, &reactor->lock_attr))
+        return ERR;
+#ifdef ASYNC_IO_URING
+    reactor->in_flight = NULL;
+    reactor->use_ring = ring_init(&reactor->ring) == OK;
+    if (reactor->use_ring) {
+        loop = ring_loop;
+        goto START_THREAD;
+    }
+#endif
+    if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        goto DESTROY_LOCK;
+    if ((reactor->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+        goto CLOSE_EPOLL;
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = reactor->wakefd};
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev))
+        goto CLOSE_EVENTFD;
+
+#ifdef ASYNC_IO_URING
+START_THREAD:
+#endif
+    {
+        // the reactor thread takes no signals meant for the pool
+        sigset_t block, old;
+        FE(sigfillset(&block));
+        FE(pthread_sigmask(SIG_SETMASK, &block, &old));
+        int err = pthread_create(&reactor->thread, NULL, loop, reactor);
+        FE(pthread_sigmask(SIG_SETMASK, &old, NULL));
+        if (err)
+            goto CLOSE_EVENTFD;
+    }
+    return OK;
+
+CLOSE_EVENTFD:
+#ifdef ASYNC_IO_URING
+    if (reactor->use_ring) {
+        ring_destroy(&reactor->ring);
+        goto DESTROY_LOCK;
+    }
+#endif
+    close(reactor->wakefd);
+CLOSE_EPOLL:
+    close(reactor->epfd);
+DESTROY_LOCK:
+    _mutex_destroy(&reactor->lock, &reactor->lock_attr);
+    return ERR;
+}
+
+static struct reactor *pool_reactor(thread_pool_t *pool) {
+    struct reactor *reactor = __atomic_load_n(&pool->reactor, __ATOMIC_ACQUIRE);
+    if (reactor)
+        return reactor;
+    FE(robust_mutex_lock(&pool->spawn_lock));
+    if ((reactor = pool->reactor) == NULL && pool->allow_adding) {
+        reactor = malloc(sizeof(*reactor));
+        if (reactor && reactor_init(reactor, pool)) {
+            free(reactor);
+            reactor = NULL;
+        }
+        __atomic_store_n(&pool->reactor, reactor, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->spawn_lock);
+    return reactor;
+}
+
+// Called by thread_pool_destroy while the pool still takes tasks, so that
+// continuations of cancelled operations can run.
+void thread_pool_reactor_stop(thread_pool_t *pool) {
+    struct reactor *reactor = pool->reactor;
+    if (reactor == NULL || reactor->stopped)
+        return;
+#ifdef ASYNC_IO_URING
+    if (reactor->use_ring) {
+        ring_stop(reactor);
+        pthread_join(reactor->thread, NULL);
+        return;
+    }
+#endif
+    uint64_t one = 1;
+    FE(write(reactor->wakefd, &one, sizeof(one)) != sizeof(one));
+    pthread_join(reactor->thread, NULL);
+    FE(robust_mutex_lock(&reactor->lock));
+    reactor->stopped = 1;
+    epoll_cancel_all(reactor);
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+// Called once the workers are gone.
+void thread_pool_reactor_free(thread_pool_t *pool) {
+    struct reactor *reactor = pool->reactor;
+    if (reactor == NULL)
+        return;
+    pool->reactor = NULL;
+#ifdef ASYNC_IO_URING
+    if (reactor->use_ring)
+        ring_destroy(&reactor->ring);
+#endif
+    if (reactor->epfd >= 0)
+        close(reactor->epfd);
+    if (reactor->wakefd >= 0)
+        close(reactor->wakefd);
+    free(reactor->fds);
+    _mutex_destroy(&reactor->lock, &reactor->lock_attr);
+    free(reactor);
+}
+
+static int async_io(thread_pool_t *pool, future_t *future, int fd, enum io_op op,
+                    short events, void *buf, size_t count) {
+    if (pool == NULL)
+        pool = thread_pool_default();
+    if (fd < 0) {
+        errno = EBADF;
+        return ERR;
+    }
+    struct reactor *reactor = pool_reactor(pool);
+    if (reactor == NULL)
+        return ERR;
+    struct io_request *req = malloc(sizeof(*req));
+    if (req == NULL)
+        return ERR;
+    *req = (struct io_request){.reactor = reactor, .future = future, .fd = fd, .op = op,
+                               .events = events, .buf = buf, .count = count};
+    int err = future_init(future);
+    if (err)
+        goto FREE_REQUEST;
+    future->pool = pool;
+    if ((err = reactor_submit(reactor, req)))
+        goto DESTROY_FUTURE;
+    return OK;
+
+DESTROY_FUTURE:
+    _mutex_destroy(&future->lock, &future->lock_attr);
+    sem_destroy(&future->on_result);
+FREE_REQUEST:
+    free(req);
+    return ERR;
+}
+
+int async_read(thread_pool_t *pool, future_t *future, int fd, void *buf,
+               size_t count) {
+    return async_io(pool, future, fd, IO_READ, POLLIN, buf, count);
+}
+
+int async_write(thread_pool_t *pool, future_t *future, int fd, const void *buf,
+                size_t count) {
+    return async_io(pool, future, fd, IO_WRITE, POLLOUT, (void *)buf, count);
+}
+
+int async_poll(thread_pool_t *pool, future_t *future, int fd, short events) {
+    return async_io(pool, future, fd, IO_POLL, events, NULL, 0);
+}
@@ -0,0 +1,32 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/types.h>
+
+#include "future.h"
+
+// I/O on file descriptors resolved without blocking a worker. The first call
+// on a pool starts its reactor thread, which waits for readiness with epoll
+// (or, built with ASYNC_IO_URING, submits the operation to io_uring) and
+// completes the future, so that map continuations run on the pool once the
+// I/O is done. Regular files, which epoll does not support, are read and
+// written by a pool task.
+//
+// read and write futures resolve to an ssize_t: the number of bytes
+// transferred, or -errno on failure. poll futures resolve to an int with the
+// POLL* events that occurred. Results are stored inline in the future.
+// Operations pending when the pool is destroyed resolve to -ECANCELED.
+// As with read(2) from several threads, concurrent reads (or writes) of one
+// descriptor may be done in any order. On a blocking descriptor a write may
+// still wait for room on the worker which runs it; use O_NONBLOCK to avoid it.
+// A NULL pool selects the default one.
+
+int async_read(thread_pool_t *pool, future_t *future, int fd, void *buf,
+               size_t count);
+
+int async_write(thread_pool_t *pool, future_t *future, int fd, const void *buf,
+                size_t count);
+
+int async_poll(thread_pool_t *pool, future_t *future, int fd, short events);
+
+#endif
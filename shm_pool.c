@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shmpool.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define COUNT 0
+#define HANG_IN_CHILD 1
+#define POISON 2
+#define TASKS 100
+
+// shared with the forked processes
+static struct {
+  int counted;
+  int hanging;
+  int done;
+  int poisoned;
+} *shared;
+
+static pid_t parent;
+static char name[64];
+
+static void count(void *arg, size_t argsz) {
+  if (argsz == sizeof(int))
+    __atomic_add_fetch(&shared->counted, *(int *)arg, __ATOMIC_SEQ_CST);
+}
+
+// The task gets stuck in the child, so that it dies holding it.
+static void hang_in_child(void *arg __attribute__((unused)),
+                          size_t argsz __attribute__((unused))) {
+  if (getpid() != parent) {
+    __atomic_store_n(&shared->hanging, 1, __ATOMIC_SEQ_CST);
+    while (1)
+      pause();
+  }
+  __atomic_add_fetch(&shared->counted, 1, __ATOMIC_SEQ_CST);
+}
+
+// Kills every consumer which runs it, but the test itself.
+static void poison(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  if (getpid() != parent)
+    kill(getpid(), SIGKILL);
+  __atomic_add_fetch(&shared->poisoned, 1, __ATOMIC_SEQ_CST);
+}
+
+static int wait_for(int *value, int expected) {
+  for (int i = 0; i < 5000 && __atomic_load_n(value, __ATOMIC_SEQ_CST) != expected; ++i)
+    usleep(1000);
+  return __atomic_load_n(value, __ATOMIC_SEQ_CST) == expected;
+}
+
+// Runs workers on the pool in a new process until shared->done is set.
+static pid_t start_consumer() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm_pool_t pool;
+    if (shm_pool_open(&pool, name) || shm_pool_start_workers(&pool, 2))
+      _exit(1);
+    while (!__atomic_load_n(&shared->done, __ATOMIC_SEQ_CST))
+      usleep(1000);
+    shm_pool_close(&pool);
+    _exit(0);
+  }
+  return pid;
+}
+
+static void reset() {
+  shared->counted = shared->hanging = shared->done = shared->poisoned = 0;
+}
+
+static char *test_open_from_other_process() {
+  shm_pool_t pool;
+  int status, one = 1;
+  reset();
+  mu_assert("create failed", shm_pool_create(&pool, name, 16, sizeof(int)) == 0);
+
+  pid_t consumer = start_consumer();
+  for (int i = 0; i < TASKS; ++i)
+    mu_assert("defer failed", shm_pool_defer(&pool, COUNT, &one, sizeof(one)) == 0);
+  mu_assert("tasks not run by the other process", wait_for(&shared->counted, TASKS));
+  shared->done = 1;
+  waitpid(consumer, &status, 0);
+  mu_assert("consumer failed", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  shm_pool_close(&pool);
+  return 0;
+}
+
+static char *test_dead_consumer_recovered() {
+  shm_pool_t pool;
+  int status;
+  reset();
+  mu_assert("create failed", shm_pool_create(&pool, name, 16, 0) == 0);
+
+  pid_t consumer = start_consumer();
+  shm_pool_defer(&pool, HANG_IN_CHILD, NULL, 0);
+  mu_assert("task not taken", wait_for(&shared->hanging, 1));
+  kill(consumer, SIGKILL);
+  waitpid(consumer, &status, 0);
+  // finding the lock abandoned recovers as well
+  mu_assert("recover failed", shm_pool_recover(&pool) >= 0);
+  mu_assert("recovered twice", shm_pool_recover(&pool) == 0);
+
+  mu_assert("start failed", shm_pool_start_workers(&pool, 1) == 0);
+  mu_assert("recovered task not run", wait_for(&shared->counted, 1));
+  shm_pool_close(&pool);
+  return 0;
+}
+
+static char *test_poison_task_dropped() {
+  shm_pool_t pool;
+  int status, one = 1;
+  reset();
+  mu_assert("create failed", shm_pool_create(&pool, name, 16, sizeof(int)) == 0);
+  shm_pool_defer(&pool, POISON, NULL, 0);
+
+  for (int i = 0; i <= SHM_POOL_MAX_RECOVERIES; ++i) {
+    pid_t consumer = start_consumer();
+    waitpid(consumer, &status, 0);
+    mu_assert("consumer survived the poison", WIFSIGNALED(status));
+    int recovered = shm_pool_recover(&pool);
+    if (i < SHM_POOL_MAX_RECOVERIES)
+      mu_assert("poison not put back", recovered == 1);
+    else
+      mu_assert("poison put back for good", recovered == 0);
+  }
+
+  // the queue is usable, and the poison is gone from it
+  mu_assert("start failed", shm_pool_start_workers(&pool, 1) == 0);
+  shm_pool_defer(&pool, COUNT, &one, sizeof(one));
+  mu_assert("task after the poison not run", wait_for(&shared->counted, 1));
+  mu_assert("dropped poison run", shared->poisoned == 0);
+  shm_pool_close(&pool);
+  return 0;
+}
+
+static char *test_truncated_segment_rejected() {
+  shm_pool_t pool, other;
+  mu_assert("create failed", shm_pool_create(&pool, name, 16, 64) == 0);
+  mu_assert("open failed", shm_pool_open(&other, name) == 0);
+  shm_pool_close(&other);
+
+  int fd = shm_open(name, O_RDWR, 0);
+  ftruncate(fd, pool.mapping_size - 64);
+  close(fd);
+  mu_assert("opened a segment too small for its slots", shm_pool_open(&other, name) != 0);
+  shm_pool_close(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_open_from_other_process);
+  mu_run_test(test_dead_consumer_recovered);
+  mu_run_test(test_poison_task_dropped);
+  mu_run_test(test_truncated_segment_rejected);
+  return 0;
+}
+
+int main() {
+  parent = getpid();
+  snprintf(name, sizeof(name), "/asyncc_shm_pool_test_%d", parent);
+  shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  shm_pool_register(COUNT, count);
+  shm_pool_register(HANG_IN_CHILD, hang_in_child);
+  shm_pool_register(POISON, poison);
+
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,451 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmpool.h"
+#include "threadpool.h"
+
+#define SHM_QUEUE_MAGIC (0x53484d5155455545ull)
+// how often idle workers look for tasks of dead workers and for stop
+#define SHM_POLL_NS (100 * 1000 * 1000)
+
+struct shm_task {
+    unsigned function_id;
+    // times put back after its consumer died
+    unsigned recoveries;
+    size_t argsz;
+    unsigned char arg[] __attribute__((aligned(16)));
+};
+
+struct shm_consumer {
+    pid_t pid;
+    int running;
+    // set while moving a task to the consumer slot, with the value of head
+    // from before the move
+    int taking;
+    size_t taken;
+};
+
+// Layout of the segment: this header, capacity queue slots, then one slot per
+// consumer holding the task it runs. A task counts as taken once head passes
+// it. Waiting is done on semaphores rather than condition variables, which
+// are not safe to use once a waiter died; the state is always rechecked under
+// the lock, and waits time out, so a post lost with a dead process only costs
+// latency.
+struct shm_queue {
+    unsigned long long magic;
+    size_t capacity;
+    size_t max_argsz;
+    size_t slot_size;
+    pthread_mutex_t lock;
+    sem_t not_empty;
+    sem_t not_full;
+    size_t waiting_consumers;
+    size_t waiting_producers;
+    size_t head, tail;
+    struct shm_consumer consumers[SHM_POOL_MAX_CONSUMERS];
+};
+
+struct shm_worker {
+    shm_pool_t *pool;
+    pthread_t thread;
+    size_t consumer;
+};
+
+static void (*registered[SHM_POOL_MAX_FUNCTIONS])(void *, size_t);
+
+static size_t shm_queue_header_size() {
+    return (sizeof(struct shm_queue) + 63) / 64 * 64;
+}
+
+static size_t shm_slot_size(size_t max_argsz) {
+    return (sizeof(struct shm_task) + max_argsz + 63) / 64 * 64;
+}
+
+// Whether the segment holds all the slots its header describes, so that
+// a truncated or foreign segment is not accessed past its end.
+static int shm_queue_fits(struct shm_queue *q, size_t mapping_size) {
+    size_t slots = q->capacity + SHM_POOL_MAX_CONSUMERS;
+    if (q->capacity == 0 || slots < q->capacity
+            || q->max_argsz > q->slot_size || q->slot_size != shm_slot_size(q->max_argsz))
+        return 0;
+    size_t available = mapping_size - shm_queue_header_size();
+    return available / q->slot_size >= slots;
+}
+
+static struct shm_task *shm_queue_slot(struct shm_queue *q, size_t index) {
+    return (struct shm_task *)((char *)q + shm_queue_header_size()
+                               + (index % q->capacity) * q->slot_size);
+}
+
+static struct shm_task *shm_consumer_slot(struct shm_queue *q, size_t consumer) {
+    return (struct shm_task *)((char *)q + shm_queue_header_size()
+                               + (q->capacity + consumer) * q->slot_size);
+}
+
+static int process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void shm_task_copy(struct shm_task *to, const struct shm_task *from) {
+    to->function_id = from->function_id;
+    to->recoveries = from->recoveries;
+    to->argsz = from->argsz;
+    memcpy(to->arg, from->arg, from->argsz);
+}
+
+// Called with the lock held.
+static void shm_queue_wake(sem_t *sem, size_t *waiting) {
+    if (*waiting > 0) {
+        (*waiting)--;
+        sem_post(sem);
+    }
+}
+
+// Called with the lock held.
+static int shm_queue_recover_locked(struct shm_queue *q) {
+    int recovered = 0;
+    for (size_t i = 0; i < SHM_POOL_MAX_CONSUMERS; ++i) {
+        struct shm_consumer *c = &q->consumers[i];
+        if (c->pid == 0 || process_alive(c->pid))
+            continue;
+        // when it died while taking a task, head tells whether it got it
+        if ((c->taking && c->taken != q->head) || (!c->taking && c->running)) {
+            struct shm_task *task = shm_consumer_slot(q, i);
+            if (task->recoveries == SHM_POOL_MAX_RECOVERIES) {
+                fprintf(stderr, "shm_pool: dropping task of function %u, which killed %d "
+                        "consumers\n", task->function_id, SHM_POOL_MAX_RECOVERIES + 1);
+            } else {
+                if (q->tail - q->head == q->capacity)
+                    continue;
+                q->head--;
+                shm_task_copy(shm_queue_slot(q, q->head), task);
+                shm_queue_slot(q, q->head)->recoveries++;
+                recovered++;
+            }
+        }
+        c->running = 0;
+        c->taking = 0;
+        c->pid = 0;
+    }
+    for (int i = 0; i < recovered; ++i)
+        shm_queue_wake(&q->not_empty, &q->waiting_consumers);
+    return recovered;
+}
+
+static int shm_queue_lock(struct shm_queue *q) {
+    int err = pthread_mutex_lock(&q->lock);
+    if (err == EOWNERDEAD) {
+        if ((err = pthread_mutex_consistent(&q->lock)))
+            return err;
+        shm_queue_recover_locked(q);
+    }
+    return err;
+}
+
+// Called with the lock held, returns with the lock held. Gives up after
+// SHM_POLL_NS, which is reported as ETIMEDOUT.
+static int shm_queue_wait(sem_t *sem, size_t *waiting, struct shm_queue *q) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SHM_POLL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    (*waiting)++;
+    pthread_mutex_unlock(&q->lock);
+    int err;
+    while ((err = sem_timedwait(sem, &deadline)) == -1 && errno == EINTR);
+    int timed_out = err == -1 && errno == ETIMEDOUT;
+    if (err == -1 && !timed_out)
+        return errno;
+    if ((err = shm_queue_lock(q)))
+        return err;
+    // on time out nobody has taken us off the waiting list
+    if (timed_out && *waiting > 0)
+        (*waiting)--;
+    return timed_out ? ETIMEDOUT : OK;
+}
+
+static int shm_queue_init(struct shm_queue *q, size_t capacity, size_t max_argsz) {
+    int err;
+    pthread_mutexattr_t lock_attr;
+
+    q->capacity = capacity;
+    q->max_argsz = max_argsz;
+    q->slot_size = shm_slot_size(max_argsz);
+    q->head = q->tail = 0;
+    q->waiting_consumers = q->waiting_producers = 0;
+
+    if ((err = pthread_mutexattr_init(&lock_attr)))
+        return err;
+    if ((err = pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_ERRORCHECK))
+            || (err = pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST))
+            || (err = pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED))
+            || (err = pthread_mutex_init(&q->lock, &lock_attr))) {
+        pthread_mutexattr_destroy(&lock_attr);
+        return err;
+    }
+    pthread_mutexattr_destroy(&lock_attr);
+
+    if (sem_init(&q->not_empty, 1 /*pshared*/, 0))
+        goto DESTROY_LOCK;
+    if (sem_init(&q->not_full, 1 /*pshared*/, 0))
+        goto DESTROY_NOT_EMPTY;
+    return OK;
+
+DESTROY_NOT_EMPTY:
+    sem_destroy(&q->not_empty);
+DESTROY_LOCK:
+    pthread_mutex_destroy(&q->lock);
+    return ERR;
+}
+
+int shm_pool_register(unsigned function_id, void (*function)(void *, size_t)) {
+    if (function_id >= SHM_POOL_MAX_FUNCTIONS)
+        return ERR;
+    registered[function_id] = function;
+    return OK;
+}
+
+static int shm_pool_map(shm_pool_t *pool, int fd, size_t size) {
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return ERR;
+    pool->queue = mapping;
+    pool->mapping_size = size;
+    pool->stop = 0;
+    pool->num_threads = 0;
+    pool->workers = NULL;
+    return OK;
+}
+
+int shm_pool_create(shm_pool_t *pool, const char *name, size_t capacity,
+                    size_t max_argsz) {
+    if (capacity == 0 || strlen(name) >= sizeof(pool->name))
+        return ERR;
+    size_t size = shm_queue_header_size()
+                  + (capacity + SHM_POOL_MAX_CONSUMERS) * shm_slot_size(max_argsz);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+        return ERR;
+    if (ftruncate(fd, size) || shm_pool_map(pool, fd, size))
+        goto UNLINK;
+    close(fd);
+
+    if (shm_queue_init(pool->queue, capacity, max_argsz)) {
+        munmap(pool->queue, size);
+        shm_unlink(name);
+        return ERR;
+    }
+    strcpy(pool->name, name);
+    pool->owner = 1;
+    __atomic_store_n(&pool->queue->magic, SHM_QUEUE_MAGIC, __ATOMIC_RELEASE);
+    return OK;
+
+UNLINK:
+    close(fd);
+    shm_unlink(name);
+    return ERR;
+}
+
+int shm_pool_open(shm_pool_t *pool, const char *name) {
+    struct stat st;
+    if (strlen(name) >= sizeof(pool->name))
+        return ERR;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return ERR;
+    if (fstat(fd, &st) || (size_t)st.st_size < shm_queue_header_size()
+            || shm_pool_map(pool, fd, st.st_size)) {
+        close(fd);
+        return ERR;
+    }
+    close(fd);
+    if (__atomic_load_n(&pool->queue->magic, __ATOMIC_ACQUIRE) != SHM_QUEUE_MAGIC
+            || !shm_queue_fits(pool->queue, pool->mapping_size)) {
+        munmap(pool->queue, pool->mapping_size);
+        return ERR;
+    }
+    strcpy(pool->name, name);
+    pool->owner = 0;
+    return OK;
+}
+
+int shm_pool_defer(shm_pool_t *pool, unsigned function_id, const void *arg,
+                   size_t argsz) {
+    struct shm_queue *q = pool->queue;
+    int err;
+    if (argsz > q->max_argsz || function_id >= SHM_POOL_MAX_FUNCTIONS)
+        return ERR;
+    if ((err = shm_queue_lock(q)))
+        return err;
+    while (q->tail - q->head == q->capacity) {
+        err = shm_queue_wait(&q->not_full, &q->waiting_producers, q);
+        if (err == ETIMEDOUT)
+            shm_queue_recover_locked(q);
+        else if (err)
+            return err;
+    }
+    struct shm_task *slot = shm_queue_slot(q, q->tail);
+    slot->function_id = function_id;
+    slot->recoveries = 0;
+    slot->argsz = argsz;
+    memcpy(slot->arg, arg, argsz);
+    q->tail++;
+    shm_queue_wake(&q->not_empty, &q->waiting_consumers);
+    pthread_mutex_unlock(&q->lock);
+    return OK;
+}
+
+int shm_pool_recover(shm_pool_t *pool) {
+    struct shm_queue *q = pool->queue;
+    if (shm_queue_lock(q))
+        return ERR;
+    int recovered = shm_queue_recover_locked(q);
+    pthread_mutex_unlock(&q->lock);
+    return recovered;
+}
+
+// Returns 1 when the task was taken into the consumer slot, 0 on stop.
+static int shm_worker_take(struct shm_worker *worker) {
+    struct shm_queue *q = worker->pool->queue;
+    struct shm_consumer *c = &q->consumers[worker->consumer];
+
+    FE(shm_queue_lock(q));
+    while (worker->pool->stop || q->tail == q->head) {
+        if (worker->pool->stop) {
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+        int err = shm_queue_wait(&q->not_empty, &q->waiting_consumers, q);
+        if (err == ETIMEDOUT)
+            shm_queue_recover_locked(q);
+        else
+            FE(err);
+    }
+    c->taken = q->head;
+    c->taking = 1;
+    shm_task_copy(shm_consumer_slot(q, worker->consumer), shm_queue_slot(q, q->head));
+    q->head++;
+    c->running = 1;
+    c->taking = 0;
+    shm_queue_wake(&q->not_full, &q->waiting_producers);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+static void* shm_worker_thread(void *arg) {
+    struct shm_worker *worker = arg;
+    struct shm_queue *q = worker->pool->queue;
+    struct shm_consumer *c = &q->consumers[worker->consumer];
+    struct shm_task *task = shm_consumer_slot(q, worker->consumer);
+
+    while (shm_worker_take(worker)) {
+        void (*function)(void *, size_t) = registered[task->function_id];
+        if (function)
+            function(task->arg, task->argsz);
+        else
+            fprintf(stderr, "shm pool %s: function %u not registered in process %d\n",
+                    worker->pool->name, task->function_id, getpid());
+        __atomic_store_n(&c->running, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int shm_claim_consumer(struct shm_queue *q, size_t *consumer) {
+    int err;
+    if ((err = shm_queue_lock(q)))
+        return err;
+    shm_queue_recover_locked(q);
+    for (size_t i = 0; i < SHM_POOL_MAX_CONSUMERS; ++i) {
+        if (q->consumers[i].pid == 0) {
+            q->consumers[i].pid = getpid();
+            q->consumers[i].running = 0;
+            *consumer = i;
+            pthread_mutex_unlock(&q->lock);
+            return OK;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ERR;
+}
+
+static void shm_release_consumer(struct shm_queue *q, size_t consumer) {
+    FE(shm_queue_lock(q));
+    q->consumers[consumer].pid = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void shm_pool_stop_workers(shm_pool_t *);
+
+int shm_pool_start_workers(shm_pool_t *pool, size_t num_threads) {
+    if (pool->workers != NULL)
+        return ERR;
+    pool->workers = calloc(num_threads, sizeof(*pool->workers));
+    if (pool->workers == NULL)
+        return ERR;
+
+    // workers leave the signals to the handler thread
+    sigset_t blocked, old;
+    FE(sigemptyset(&blocked));
+    FE(sigaddset(&blocked, SIGINT));
+    FE(sigaddset(&blocked, SIGUSR1));
+    FE(pthread_sigmask(SIG_BLOCK, &blocked, &old));
+
+    size_t i;
+    for (i = 0; i < num_threads; ++i) {
+        struct shm_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        if (shm_claim_consumer(pool->queue, &worker->consumer))
+            break;
+        if (pthread_create(&worker->thread, NULL, shm_worker_thread, worker)) {
+            shm_release_consumer(pool->queue, worker->consumer);
+            break;
+        }
+    }
+    FE(pthread_sigmask(SIG_SETMASK, &old, NULL));
+    pool->num_threads = i;
+    if (i < num_threads) {
+        shm_pool_stop_workers(pool);
+        return ERR;
+    }
+    return OK;
+}
+
+static void shm_pool_stop_workers(shm_pool_t *pool) {
+    struct shm_queue *q = pool->queue;
+    if (pool->workers) {
+        FE(shm_queue_lock(q));
+        pool->stop = 1;
+        while (q->waiting_consumers > 0)
+            shm_queue_wake(&q->not_empty, &q->waiting_consumers);
+        pthread_mutex_unlock(&q->lock);
+        for (size_t i = 0; i < pool->num_threads; ++i) {
+            pthread_join(pool->workers[i].thread, NULL);
+            shm_release_consumer(q, pool->workers[i].consumer);
+        }
+        free(pool->workers);
+        pool->workers = NULL;
+        pool->num_threads = 0;
+        pool->stop = 0;
+    }
+}
+
+void shm_pool_close(shm_pool_t *pool) {
+    shm_pool_stop_workers(pool);
+    munmap(pool->queue, pool->mapping_size);
+    if (pool->owner)
+        shm_unlink(pool->name);
+}
@@ -0,0 +1,55 @@
+#ifndef SHMPOOL_H
+#define SHMPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define SHM_POOL_MAX_FUNCTIONS (256)
+#define SHM_POOL_MAX_CONSUMERS (64)
+// times a task is put back after its consumer died running it
+#define SHM_POOL_MAX_RECOVERIES (3)
+
+struct shm_queue;
+struct shm_worker;
+
+// Task queue in a named shared memory segment, consumed by worker threads of
+// any process which opens it. A task is a function id, registered with the
+// same function in every process, and up to max_argsz bytes of argument
+// copied into the segment. Tasks taken by a worker whose process died are
+// put back at the front of the queue, up to SHM_POOL_MAX_RECOVERIES times;
+// a task which keeps killing its consumers is then dropped, with a message
+// on stderr.
+typedef struct shm_pool {
+    struct shm_queue *queue;
+    size_t mapping_size;
+    short owner;
+    short stop;
+    size_t num_threads;
+    struct shm_worker *workers;
+    char name[256];
+} shm_pool_t;
+
+int shm_pool_register(unsigned function_id, void (*function)(void *, size_t));
+
+int shm_pool_create(shm_pool_t *pool, const char *name, size_t capacity,
+                    size_t max_argsz);
+
+int shm_pool_open(shm_pool_t *pool, const char *name);
+
+// Starts num_threads workers in the calling process.
+int shm_pool_start_workers(shm_pool_t *pool, size_t num_threads);
+
+int shm_pool_defer(shm_pool_t *pool, unsigned function_id, const void *arg,
+                   size_t argsz);
+
+// Requeues tasks of dead workers, returns their number or -1 on error.
+// Workers do it on their own when idle and when they find the queue lock
+// abandoned.
+int shm_pool_recover(shm_pool_t *pool);
+
+// Stops workers of this process and unmaps the segment. The creator also
+// removes the segment name.
+void shm_pool_close(shm_pool_t *pool);
+
+#endif
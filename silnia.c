@@ -3,64 +3,175 @@
 #include <stdint.h>
 #include <inttypes.h>
 
-#include <unistd.h>
-
+#include "bignum.h"
 #include "future.h"
 
-#define SIZE 0xCAFEBABE
-
-static unsigned n;
+// Leaves of the product tree per worker, more leaves even out their sizes.
+#define LEAVES_PER_WORKER (8)
+// Operands shorter than that are multiplied by a single task.
+#define SPLIT_MIN_LIMBS (2048)
 
-struct data {
-    uint64_t pref_prod;
-    unsigned mult;
+struct range {
+    uint64_t lo, hi;
+    bignum_t product;
 };
 
-void* factorial_step(void* arg, __attribute__((unused)) size_t size, size_t* ressz) {
-    struct data* d = arg;
-    d->pref_prod *= d->mult;
-    d->mult += 3;
-    *ressz = SIZE;
-    return d;
+void* range_product(void* arg, __attribute__((unused)) size_t size, size_t* ressz) {
+    struct range* r = arg;
+    if (bignum_range_product(&r->product, r->lo, r->hi))
+        return NULL;
+    *ressz = sizeof(r->product);
+    return &r->product;
 }
 
-int main(){
-    //setvbuf(stdout, NULL, _IONBF, 0);
-    //printf("pid: %d\n", getpid());
-    if (1 != scanf("%u", &n))
-        return EXIT_FAILURE;
+// Multiplication of two nodes of the tree. While there are fewer nodes than
+// workers, the multiplication is split Karatsuba-style into three smaller ones,
+// recursively, and only those run as tasks.
+struct split_mul {
+    const uint32_t *a, *b;
+    size_t na, nb;
+    uint32_t *product;
+    // split point of both operands, parts are a0*b0, a1*b1, (a0+a1)*(b0+b1)
+    size_t m;
+    struct split_mul *part;
+    uint32_t *sums;
+    future_t future;
+};
 
+void* multiply(void* arg, __attribute__((unused)) size_t size, size_t* ressz) {
+    struct split_mul* s = arg;
+    if (limbs_mul(s->product, s->a, s->na, s->b, s->nb))
+        return NULL;
+    *ressz = (s->na + s->nb) * sizeof(*s->product);
+    return s->product;
+}
 
-    thread_pool_t pool;
-    if (thread_pool_init(&pool, 3))
-        return EXIT_FAILURE;
+static int split_mul_start(thread_pool_t* pool, struct split_mul* s,
+                           const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                           uint32_t* product, int depth) {
+    *s = (struct split_mul){.a = a, .na = na, .b = b, .nb = nb, .product = product};
+    size_t shorter = na < nb ? na : nb;
+    if (depth == 0 || shorter < SPLIT_MIN_LIMBS) {
+        callable_t callable = {.function = multiply, .arg = s, .argsz = sizeof(*s)};
+        return async(pool, &s->future, callable);
+    }
 
+    size_t m = shorter / 2, ha = na - m, hb = nb - m;
+    s->m = m;
+    s->part = calloc(3, sizeof(*s->part));
+    // a0+a1, b0+b1 and their product
+    s->sums = malloc(2 * (ha + 1 + hb + 1) * sizeof(*s->sums));
+    if (s->part == NULL || s->sums == NULL)
+        return ERR;
+    uint32_t *sa = s->sums, *sb = sa + ha + 1, *z1 = sb + hb + 1;
+    limbs_add(sa, a, m, a + m, ha);
+    limbs_add(sb, b, m, b + m, hb);
 
-    future_t *fut = calloc(n, sizeof (*fut));
-    if (fut == NULL)
-        return EXIT_FAILURE;
+    if (split_mul_start(pool, &s->part[0], a, m, b, m, product, depth - 1)
+            || split_mul_start(pool, &s->part[1], a + m, ha, b + m, hb, product + 2 * m, depth - 1)
+            || split_mul_start(pool, &s->part[2], sa, ha + 1, sb, hb + 1, z1, depth - 1))
+        return ERR;
+    return OK;
+}
 
-    callable_t callable = {.function = factorial_step, .argsz = SIZE};
+static int split_mul_finish(struct split_mul* s) {
+    if (s->part == NULL)
+        return await(&s->future) == NULL ? ERR : OK;
 
-    struct data dane[3];
-    for (unsigned i = 0; i < 3 && i < n; ++i) {
-        dane[i] = (struct data){.mult = i+1, .pref_prod = 1};
-        callable.arg = &dane[i];
-        if (async(&pool, fut + i, callable))
-            return EXIT_FAILURE;
+    for (int i = 0; i < 3; ++i) {
+        if (split_mul_finish(&s->part[i]))
+            return ERR;
     }
+    size_t m = s->m, ha = s->na - m, hb = s->nb - m;
+    uint32_t *z1 = s->sums + ha + 1 + hb + 1;
+    size_t nz1 = ha + 1 + hb + 1;
+    limbs_sub_from(z1, nz1, s->product, 2 * m);
+    limbs_sub_from(z1, nz1, s->product + 2 * m, ha + hb);
+    limbs_add_to(s->product + m, s->na + s->nb - m, z1, limbs_normalized_size(z1, nz1));
+    free(s->part);
+    free(s->sums);
+    return OK;
+}
 
-    for (unsigned i = 3; i < n; ++i) {
-        if (map(&pool, fut + i, fut + i - 3, factorial_step))
-            return EXIT_FAILURE;
+// result = n!, computed on the pool
+static int factorial(thread_pool_t* pool, uint64_t n, bignum_t* result) {
+    size_t workers = pool->pool_size;
+    size_t count = n < workers * LEAVES_PER_WORKER ? n : workers * LEAVES_PER_WORKER;
+    if (count == 0)
+        count = 1;
+
+    struct range* ranges = calloc(count, sizeof(*ranges));
+    future_t* futures = calloc(count, sizeof(*futures));
+    bignum_t* level = calloc(count, sizeof(*level));
+    if (ranges == NULL || futures == NULL || level == NULL)
+        return ERR;
+
+    for (size_t i = 0; i < count; ++i) {
+        ranges[i].lo = 1 + n * i / count;
+        ranges[i].hi = 1 + n * (i + 1) / count;
+        callable_t callable = {.function = range_product,
+                               .arg = &ranges[i],
+                               .argsz = sizeof(ranges[i])};
+        if (async(pool, futures + i, callable))
+            return ERR;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (await(futures + i) == NULL)
+            return ERR;
+        level[i] = ranges[i].product;
     }
+    free(futures);
+    free(ranges);
 
-    uint64_t fact = 1;
-    for (unsigned i = 0; i < 3 && i < n; ++i) {
-        struct data* d = await(fut + n - i - 1);
-        fact *= d->pref_prod;
+    // multiply neighbours level by level, all products of a level at once
+    while (count > 1) {
+        size_t pairs = count / 2;
+        int depth = 0;
+        for (size_t tasks = pairs; tasks < workers; tasks *= 3)
+            depth++;
+
+        struct split_mul* muls = calloc(pairs, sizeof(*muls));
+        if (muls == NULL)
+            return ERR;
+        for (size_t i = 0; i < pairs; ++i) {
+            bignum_t *a = &level[2 * i], *b = &level[2 * i + 1];
+            uint32_t* product = malloc((a->size + b->size) * sizeof(*product));
+            if (product == NULL || split_mul_start(pool, &muls[i], a->limb, a->size,
+                                                   b->limb, b->size, product, depth))
+                return ERR;
+        }
+        for (size_t i = 0; i < pairs; ++i) {
+            if (split_mul_finish(&muls[i]))
+                return ERR;
+            size_t size = muls[i].na + muls[i].nb;
+            bignum_destroy(&level[2 * i]);
+            bignum_destroy(&level[2 * i + 1]);
+            level[i] = (bignum_t){.limb = muls[i].product,
+                                  .size = limbs_normalized_size(muls[i].product, size),
+                                  .capacity = size};
+        }
+        if (count % 2)
+            level[pairs] = level[count - 1];
+        count = pairs + count % 2;
+        free(muls);
     }
-    free(fut);
-    thread_pool_destroy(&pool);
-    printf("%" PRIu64 "\n", fact);
+
+    *result = level[0];
+    free(level);
+    return OK;
+}
+
+int main(){
+    uint64_t n;
+    bignum_t result;
+    if (1 != scanf("%" SCNu64, &n))
+        return EXIT_FAILURE;
+
+    thread_pool_t* pool = thread_pool_default();
+    int err = factorial(pool, n, &result);
+    thread_pool_destroy(pool);
+    if (err || bignum_print(stdout, &result))
+        return EXIT_FAILURE;
+    bignum_destroy(&result);
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+
+#include "stream.h"
+#include "lock.h"
+
+extern int thread_pool_cond_wait(thread_pool_t *, pthread_cond_t *, pthread_mutex_t *);
+
+extern void worker_name_task(void *);
+
+struct each_task {
+    async_stream_t *stream;
+    struct async_stream_item item;
+};
+
+int async_stream_init(async_stream_t *stream, thread_pool_t *pool, size_t capacity) {
+    int err;
+    if (capacity == 0)
+        return ERR;
+    stream->pool = pool;
+    stream->capacity = capacity;
+    stream->head = stream->count = stream->in_flight = 0;
+    stream->closed = 0;
+    stream->each = NULL;
+    stream->each_context = NULL;
+    if ((stream->items = malloc(capacity * sizeof(*stream->items))) == NULL)
+        return ERR;
+    if ((err = _mutex_init(&stream->lock, &stream->lock_attr)))
+        goto FREE_ITEMS;
+    if ((err = pthread_cond_init(&stream->not_full, NULL)))
+        goto DESTROY_LOCK;
+    if ((err = pthread_cond_init(&stream->not_empty, NULL)))
+        goto DESTROY_NOT_FULL;
+    if ((err = pthread_cond_init(&stream->drained, NULL)))
+        goto DESTROY_NOT_EMPTY;
+    return OK;
+
+DESTROY_NOT_EMPTY:
+    pthread_cond_destroy(&stream->not_empty);
+DESTROY_NOT_FULL:
+    pthread_cond_destroy(&stream->not_full);
+DESTROY_LOCK:
+    _mutex_destroy(&stream->lock, &stream->lock_attr);
+FREE_ITEMS:
+    free(stream->items);
+    return ERR;
+}
+
+void async_stream_destroy(async_stream_t *stream) {
+    FE(robust_mutex_lock(&stream->lock));
+    while (stream->in_flight > 0)
+        FE(thread_pool_cond_wait(stream->pool, &stream->drained, &stream->lock));
+    pthread_mutex_unlock(&stream->lock);
+    pthread_cond_destroy(&stream->drained);
+    pthread_cond_destroy(&stream->not_empty);
+    pthread_cond_destroy(&stream->not_full);
+    _mutex_destroy(&stream->lock, &stream->lock_attr);
+    free(stream->items);
+}
+
+// Must hold the lock.
+static void stream_signal_drained(async_stream_t *stream) {
+    if (stream->closed && stream->count == 0 && stream->in_flight == 0)
+        FE(pthread_cond_broadcast(&stream->drained));
+}
+
+static void run_each(void *arg, __attribute__((unused)) size_t argsz) {
+    struct each_task *task = arg;
+    async_stream_t *stream = task->stream;
+    worker_name_task((void *)stream->each);
+    stream->each(task->item.value, task->item.size, stream->each_context);
+    free(task);
+
+    FE(robust_mutex_lock(&stream->lock));
+    stream->in_flight--;
+    FE(pthread_cond_signal(&stream->not_full));
+    // wakes async_stream_destroy as well as async_stream_wait
+    if (stream->in_flight == 0)
+        FE(pthread_cond_broadcast(&stream->drained));
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Must hold the lock.
+static int stream_dispatch(async_stream_t *stream, struct async_stream_item item) {
+    struct each_task *task = malloc(sizeof(*task));
+    if (task == NULL)
+        return ERR;
+    task->stream = stream;
+    task->item = item;
+    runnable_t runnable = {.function = run_each, .arg = task, .argsz = sizeof(*task)};
+    if (defer(stream->pool, runnable)) {
+        free(task);
+        return ERR;
+    }
+    stream->in_flight++;
+    return OK;
+}
+
+int async_stream_push(async_stream_t *stream, void *value, size_t size) {
+    int err = OK;
+    FE(robust_mutex_lock(&stream->lock));
+    while (!stream->closed && stream->count + stream->in_flight >= stream->capacity)
+        FE(thread_pool_cond_wait(stream->pool, &stream->not_full, &stream->lock));
+    if (stream->closed) {
+        err = ERR;
+    } else if (stream->each) {
+        err = stream_dispatch(stream, (struct async_stream_item){value, size});
+    } else {
+        size_t tail = (stream->head + stream->count) % stream->capacity;
+        stream->items[tail] = (struct async_stream_item){value, size};
+        stream->count++;
+        FE(pthread_cond_signal(&stream->not_empty));
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return err;
+}
+
+void async_stream_close(async_stream_t *stream) {
+    FE(robust_mutex_lock(&stream->lock));
+    stream->closed = 1;
+    FE(pthread_cond_broadcast(&stream->not_empty));
+    FE(pthread_cond_broadcast(&stream->not_full));
+    stream_signal_drained(stream);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+size_t async_stream_pull(async_stream_t *stream, struct async_stream_item *items,
+                         size_t max) {
+    size_t taken = 0;
+    FE(robust_mutex_lock(&stream->lock));
+    while (!stream->closed && stream->count == 0)
+        FE(thread_pool_cond_wait(stream->pool, &stream->not_empty, &stream->lock));
+    for (; taken < max && stream->count > 0; ++taken) {
+        items[taken] = stream->items[stream->head];
+        stream->head = (stream->head + 1) % stream->capacity;
+        stream->count--;
+    }
+    if (taken > 0)
+        FE(pthread_cond_broadcast(&stream->not_full));
+    stream_signal_drained(stream);
+    pthread_mutex_unlock(&stream->lock);
+    return taken;
+}
+
+int async_stream_for_each(async_stream_t *stream,
+                          void (*each)(void *value, size_t size, void *context),
+                          void *context) {
+    int err = OK;
+    FE(robust_mutex_lock(&stream->lock));
+    if (stream->each) {
+        pthread_mutex_unlock(&stream->lock);
+        return ERR;
+    }
+    stream->each = each;
+    stream->each_context = context;
+    while (stream->count > 0) {
+        if ((err = stream_dispatch(stream, stream->items[stream->head])))
+            break;
+        stream->head = (stream->head + 1) % stream->capacity;
+        stream->count--;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return err;
+}
+
+void async_stream_wait(async_stream_t *stream) {
+    FE(robust_mutex_lock(&stream->lock));
+    while (!stream->closed || stream->count > 0 || stream->in_flight > 0)
+        FE(thread_pool_cond_wait(stream->pool, &stream->drained, &stream->lock));
+    pthread_mutex_unlock(&stream->lock);
+}
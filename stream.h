@@ -0,0 +1,67 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+struct async_stream_item {
+    void *value;
+    size_t size;
+};
+
+// Sequence of values passed from a producer to consumers while it is being
+// produced. At most capacity values are buffered or being processed by
+// for_each continuations at a time; beyond that the producer blocks in
+// async_stream_push. Values are pointers owned by whoever takes them.
+typedef struct async_stream {
+    thread_pool_t *pool;
+    pthread_mutex_t lock;
+    pthread_mutexattr_t lock_attr;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    pthread_cond_t drained;
+    // ring buffer of count items starting at head
+    struct async_stream_item *items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    // items handed to for_each and not processed yet
+    size_t in_flight;
+    int closed;
+    void (*each)(void *value, size_t size, void *context);
+    void *each_context;
+} async_stream_t;
+
+int async_stream_init(async_stream_t *stream, thread_pool_t *pool, size_t capacity);
+
+// Waits for the for_each continuations still running. Values left in the
+// buffer are dropped.
+void async_stream_destroy(async_stream_t *stream);
+
+// Blocks while the stream is full; fails once it is closed. A producer
+// running on the pool should leave workers for the consumers.
+int async_stream_push(async_stream_t *stream, void *value, size_t size);
+
+// No more values will be pushed.
+void async_stream_close(async_stream_t *stream);
+
+// Takes up to max buffered values, in the order they were pushed, waiting
+// for at least one. Returns 0 once the stream is closed and empty.
+size_t async_stream_pull(async_stream_t *stream, struct async_stream_item *items,
+                         size_t max);
+
+// Runs each(value, size, context) on the pool for every value pushed from now
+// on and for those already buffered, instead of buffering them. Runs for
+// different values may overlap and finish in any order. Cannot be combined
+// with pull.
+int async_stream_for_each(async_stream_t *stream,
+                          void (*each)(void *value, size_t size, void *context),
+                          void *context);
+
+// Waits until the stream is closed and all its values have been taken or
+// processed by for_each.
+void async_stream_wait(async_stream_t *stream);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "counters.h"
+#include "future.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define RUNS 200
+
+static sem_t finished;
+
+static void spin(void *arg __attribute__((unused)),
+                 size_t argsz __attribute__((unused))) {
+  volatile unsigned long sink = 0;
+  for (unsigned long i = 0; i < 200000; ++i)
+    sink += i;
+  sem_post(&finished);
+}
+
+static void quick(void *arg __attribute__((unused)),
+                  size_t argsz __attribute__((unused))) {
+  sem_post(&finished);
+}
+
+static void run(thread_pool_t *pool, void (*function)(void *, size_t), int times) {
+  for (int i = 0; i < times; ++i)
+    defer(pool, (runnable_t){.function = function});
+  for (int i = 0; i < times; ++i)
+    while (sem_wait(&finished) != 0);
+}
+
+static task_counters_entry_t *find(task_counters_entry_t *entries, size_t count,
+                                   void *function) {
+  for (size_t i = 0; i < count; ++i)
+    if (entries[i].function == function)
+      return &entries[i];
+  return NULL;
+}
+
+// Tasks are counted after they return, which is after they post finished.
+static size_t settled_query(thread_pool_t *pool, task_counters_entry_t *entries,
+                            size_t max, unsigned long runs) {
+  size_t count;
+  for (int tries = 0; tries < 1000; ++tries) {
+    unsigned long total = 0;
+    count = thread_pool_counters_query(pool, entries, max);
+    for (size_t i = 0; i < count && i < max; ++i)
+      total += entries[i].runs;
+    if (total >= runs)
+      break;
+    usleep(1000);
+  }
+  return count;
+}
+
+static char *test_per_function() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  sem_init(&finished, 0, 0);
+  task_counters_entry_t entries[8];
+
+  run(&pool, quick, 10);
+  mu_assert("counted before start", thread_pool_counters_query(&pool, entries, 8) == 0);
+
+  mu_assert("start failed", thread_pool_counters_start(&pool) == 0);
+  run(&pool, spin, RUNS);
+  run(&pool, quick, RUNS);
+  size_t count = settled_query(&pool, entries, 8, 2 * RUNS);
+  mu_assert("wrong number of functions", count == 2);
+  task_counters_entry_t *slow = find(entries, count, (void *)spin);
+  task_counters_entry_t *fast = find(entries, count, (void *)quick);
+  mu_assert("function missing", slow != NULL && fast != NULL);
+  mu_assert("wrong number of runs", slow->runs == RUNS && fast->runs == RUNS);
+  mu_assert("not ordered by time", entries[0].function == (void *)spin && slow->ns > fast->ns);
+  if (thread_pool_counters_available(&pool) & (1u << TASK_INSTRUCTIONS))
+    mu_assert("instructions not counted",
+              slow->counters[TASK_INSTRUCTIONS] > fast->counters[TASK_INSTRUCTIONS]);
+  else
+    mu_assert("counter not available but counted", slow->counters[TASK_INSTRUCTIONS] == 0);
+
+  thread_pool_counters_stop(&pool);
+  run(&pool, quick, 10);
+  thread_pool_counters_query(&pool, entries, 8);
+  mu_assert("counted after stop", find(entries, 2, (void *)quick)->runs == RUNS);
+
+  char *report = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&report, &size);
+  thread_pool_counters_dump(&pool, out);
+  fclose(out);
+  mu_assert("report without header", strstr(report, "instructions") != NULL);
+  mu_assert("report without entries", strstr(report, " 200 ") != NULL);
+  free(report);
+
+  sem_destroy(&finished);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void *answer(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                    size_t *retsz) {
+  *retsz = 0;
+  return NULL;
+}
+
+static void *question(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                      size_t *retsz) {
+  *retsz = 0;
+  return NULL;
+}
+
+static char *test_async_functions_apart() {
+  thread_pool_t pool;
+  future_t futures[2 * RUNS];
+  task_counters_entry_t entries[8];
+  thread_pool_init(&pool, 2);
+  mu_assert("start failed", thread_pool_counters_start(&pool) == 0);
+
+  for (int i = 0; i < 2 * RUNS; ++i)
+    async(&pool, &futures[i], (callable_t){.function = i % 2 ? answer : question});
+  for (int i = 0; i < 2 * RUNS; ++i)
+    await(&futures[i]);
+  size_t count = settled_query(&pool, entries, 8, 2 * RUNS);
+  mu_assert("async tasks not told apart", count == 2);
+  task_counters_entry_t *first = find(entries, count, (void *)answer);
+  task_counters_entry_t *second = find(entries, count, (void *)question);
+  mu_assert("counted under the trampoline", first != NULL && second != NULL);
+  mu_assert("wrong number of runs", first->runs == RUNS && second->runs == RUNS);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_per_function);
+  mu_run_test(test_async_functions_apart);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "group.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+#define TASKS 100000
+
+static int counter;
+
+static void count(void *arg __attribute__((unused)),
+                  size_t argsz __attribute__((unused))) {
+  __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+static char *test_wait() {
+  thread_pool_t pool;
+  task_group_t group;
+  thread_pool_init(&pool, 4);
+  task_group_init(&group);
+  counter = 0;
+  for (int i = 0; i < TASKS; ++i)
+    mu_assert("defer failed",
+              task_group_defer(&group, &pool, (runnable_t){.function = count}) == 0);
+  mu_assert("error reported", task_group_wait(&group) == 0);
+  mu_assert("returned before all tasks", counter == TASKS);
+
+  // reused after the wait
+  task_group_defer(&group, &pool, (runnable_t){.function = count});
+  mu_assert("error reported", task_group_wait(&group) == 0);
+  mu_assert("second round lost", counter == TASKS + 1);
+
+  // nothing deferred at all
+  mu_assert("error reported", task_group_wait(&group) == 0);
+
+  task_group_destroy(&group);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static sem_t started, release;
+
+static void block(void *arg __attribute__((unused)),
+                  size_t argsz __attribute__((unused))) {
+  sem_post(&started);
+  while (sem_wait(&release) != 0);
+  __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+static void fail_io(void *arg __attribute__((unused)),
+                    size_t argsz __attribute__((unused))) {
+  task_group_fail(task_group_current(), EIO);
+}
+
+static char *test_fail_skips_pending() {
+  thread_pool_t pool;
+  task_group_t group;
+  thread_pool_init(&pool, 1);
+  task_group_init(&group);
+  sem_init(&started, 0, 0);
+  sem_init(&release, 0, 0);
+  counter = 0;
+
+  // one worker: the failing task runs before any of the counting ones
+  task_group_defer(&group, &pool, (runnable_t){.function = fail_io});
+  for (int i = 0; i < 100; ++i)
+    task_group_defer(&group, &pool, (runnable_t){.function = count});
+  mu_assert("wrong error", task_group_wait(&group) == EIO);
+  mu_assert("tasks after the failure ran", counter == 0);
+  mu_assert("current group outside of a task", task_group_current() == NULL);
+
+  task_group_defer(&group, &pool, (runnable_t){.function = block});
+  task_group_defer(&group, &pool, (runnable_t){.function = count});
+  while (sem_wait(&started) != 0);
+  task_group_cancel(&group);
+  mu_assert("deferred into a cancelled group",
+            task_group_defer(&group, &pool, (runnable_t){.function = count}) != 0);
+  sem_post(&release);
+  mu_assert("wrong error", task_group_wait(&group) == ECANCELED);
+  mu_assert("running task not finished or pending one not skipped", counter == 1);
+
+  sem_destroy(&started);
+  sem_destroy(&release);
+  task_group_destroy(&group);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+struct done_check {
+  task_group_t *group;
+  int counted;
+  sem_t done;
+};
+
+static void on_done(void *arg, size_t argsz __attribute__((unused))) {
+  struct done_check *check = arg;
+  check->counted = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+  task_group_destroy(check->group);
+  free(check->group);
+  sem_post(&check->done);
+}
+
+static char *test_on_done() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+  struct done_check check = {.group = malloc(sizeof(task_group_t))};
+  sem_init(&check.done, 0, 0);
+  task_group_init(check.group);
+  counter = 0;
+  for (int i = 0; i < TASKS; ++i)
+    task_group_defer(check.group, &pool, (runnable_t){.function = count});
+  task_group_on_done(check.group, &pool,
+                     (runnable_t){.function = on_done, .arg = &check});
+  while (sem_wait(&check.done) != 0);
+  mu_assert("continuation ran before all tasks", check.counted == TASKS);
+
+  sem_destroy(&check.done);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_wait);
+  mu_run_test(test_fail_skips_pending);
+  mu_run_test(test_on_done);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -6,23 +6,42 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include "threadpool.h"
+#include "lock.h"
 
-static void deque_init(deque_t *d);
-static void deque_destroy(deque_t *d);
-static size_t deque_size(deque_t *d);
-static int deque_is_empty(deque_t *d);
-static int deque_push_back(deque_t *d, runnable_t * val);
-static int deque_pop_front(deque_t *d, runnable_t * val);
-static int deque_pop_back(deque_t *d, runnable_t * val);
+void deque_init(deque_t *d);
+void deque_destroy(deque_t *d);
+size_t deque_size(deque_t *d);
+int deque_is_empty(deque_t *d);
+int deque_push_back(deque_t *d, runnable_t * val);
+int deque_pop_front(deque_t *d, runnable_t * val);
+int deque_pop_back(deque_t *d, runnable_t * val);
+int deque_pop_nth(deque_t *d, size_t n, runnable_t * val);
 
 static int blocking_deque_init(blocking_deque_t *d);
 static int blocking_deque_destroy(blocking_deque_t *d);
 static int blocking_deque_push_back(blocking_deque_t *d, runnable_t * val);
-static int blocking_deque_pop_front(blocking_deque_t *d, runnable_t * val);
+static int blocking_deque_try_pop_front(blocking_deque_t *d, runnable_t * val);
 
 static void* handler_thread(void*);
-static void handle_sigint(__attribute__((unused)) int signo) {}
+static void inbox_init(inbox_t *inbox);
+static void inbox_destroy(inbox_t *inbox);
+static int inbox_push(inbox_t *inbox, runnable_t *val);
+static int inbox_pop(inbox_t *inbox, runnable_t *val);
+static void worker_arena_reset(worker_t *worker);
+static void worker_arena_free(worker_t *worker);
+static void handle_sigint(int signo);
+
+struct schedule {
+    size_t virtual_workers;
+    unsigned long long state;
+    schedule_entry_t *log;
+    size_t length;
+    size_t capacity;
+};
 
 struct vector {
     thread_pool_t **arr;
@@ -34,14 +53,27 @@ struct vector {
 
 // thread id of supervising thread
 pthread_t handler_tid;
+static short handler_started;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
 // this structure holds global info about running threads
 static struct vector active_pools;
+static short active_pools_ready;
+static pthread_once_t active_pools_once = PTHREAD_ONCE_INIT;
+
+// worker run by the calling thread, NULL outside of pools
+__thread worker_t *current_worker;
+// arena of tasks of pools of size 0 run by a thread which is not a worker,
+// and how deeply they are nested
+static __thread arena_chunk_t *inline_arena;
+static __thread int inline_depth;
+
+static thread_pool_t default_pool;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
 
 static int struct_vector_init(struct vector*);
 static int struct_vector_push_back(struct vector*, thread_pool_t*);
 static void struct_vector_destroy(struct vector*);
 static void struct_vector_remove(struct vector* , thread_pool_t* );
-int robust_mutex_lock(pthread_mutex_t *);
 
 // Print backtrace and exit. Used only in non-recoverable situations.
 void fatal_error(int e) {
@@ -62,34 +94,75 @@ void fatal_error(int e) {
 
 void FE(int) __attribute__((alias("fatal_error")));
 
-__attribute__((constructor)) static void set_handlers() {
+static void handled_signals(sigset_t *set) {
+    FE(sigemptyset(set));
+    FE(sigaddset(set, SIGINT));
+    FE(sigaddset(set, SIGUSR1));
+}
+
+// Started together with the first worker, so that programs which never
+// submit a task do not pay for any threads. Only threads created afterwards
+// inherit the blocked signals; in those created before SIGINT is caught by
+// handle_sigint and passed on to the handler thread.
+static void set_handlers() {
+    sigset_t sigint_block;
+    handled_signals(&sigint_block);
+    FE(sigprocmask(SIG_BLOCK, &sigint_block, NULL));
+    FE(pthread_create(&handler_tid, NULL, handler_thread, NULL));
+    __atomic_store_n(&handler_started, 1, __ATOMIC_RELEASE);
+
     struct sigaction act = {};
     act.sa_handler = handle_sigint;
     FE(sigaction(SIGINT, &act, NULL));
+}
 
-    sigset_t sigint_block;
-    FE(sigemptyset(&sigint_block));
-    FE(sigaddset(&sigint_block, SIGINT));
-    FE(sigaddset(&sigint_block, SIGUSR1));
-    FE(sigprocmask(SIG_BLOCK, &sigint_block, NULL));
+// The handler thread blocks the signal, so it stays pending for its sigwait.
+static void handle_sigint(int signo) {
+    if (__atomic_load_n(&handler_started, __ATOMIC_ACQUIRE))
+        pthread_kill(handler_tid, signo);
+}
+
+static void init_active_pools() {
     FE(struct_vector_init(&active_pools));
-    FE(pthread_create(&handler_tid, NULL, handler_thread, NULL));
+    active_pools_ready = 1;
+}
+
+static void init_default_pool() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    FE(thread_pool_init(&default_pool, cpus > 0 ? cpus : 1));
 }
 
 __attribute__((destructor)) void finish_work() {
-    struct_vector_destroy(&active_pools);
-    pthread_kill(handler_tid, SIGUSR1);
-    pthread_join(handler_tid, NULL);
+    if (active_pools_ready)
+        struct_vector_destroy(&active_pools);
+    if (handler_started) {
+        __atomic_store_n(&handler_started, 0, __ATOMIC_RELEASE);
+        pthread_kill(handler_tid, SIGUSR1);
+        pthread_join(handler_tid, NULL);
+    }
 }
 
+static int thread_pool_wake_worker(thread_pool_t *);
+extern unsigned long long watchdog_clock(void);
+extern void thread_pool_reactor_stop(thread_pool_t *);
+extern void thread_pool_reactor_free(thread_pool_t *);
+extern int thread_pool_counters_begin(thread_pool_t *, worker_t *);
+extern void thread_pool_counters_end(thread_pool_t *, worker_t *, void *);
+extern void thread_pool_counters_free(thread_pool_t *);
+
 
 static void thread_pool_halt_threads(thread_pool_t* pool) {
     if (!pool->allow_adding || pool->deleted)
         return;
-    pool->allow_adding = 0;
-    for (__typeof (pool->pool_size) i = 0; i < pool->pool_size; ++i) {
+    // cancelled I/O may still defer its continuations
+    thread_pool_reactor_stop(pool);
+    FE(robust_mutex_lock(&pool->spawn_lock));
+    __atomic_store_n(&pool->allow_adding, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->spawn_lock);
+    for (__typeof (pool->spawned) i = 0; i < pool->spawned; ++i) {
         runnable_t r = {};
         FE(blocking_deque_push_back(&pool->tasks, &r));
+        FE(thread_pool_wake_worker(pool));
     }
 }
 
@@ -97,13 +170,27 @@ static void thread_pool_decomission_resources(thread_pool_t* pool) {
     if (pool->deleted)
         return;
     pool->deleted = 1;
+    thread_pool_watchdog_stop(pool);
     pthread_t self = pthread_self();
-    for (size_t i = 0; i < pool->pool_size; ++i) {
-        if (!pthread_equal(self, pool->threads[i]))
-            pthread_join(pool->threads[i], NULL);
+    for (size_t i = 0; i < pool->spawned; ++i) {
+        runnable_t runnable;
+        if (!pthread_equal(self, pool->workers[i].thread))
+            pthread_join(pool->workers[i].thread, NULL);
+        // a worker may leave on its stop task with its inbox not empty
+        while (inbox_pop(&pool->workers[i].inbox, &runnable) == OK)
+            runnable.function(runnable.arg, runnable.argsz);
+        sem_destroy(&pool->workers[i].wake);
+        inbox_destroy(&pool->workers[i].inbox);
+        worker_arena_free(&pool->workers[i]);
     }
+    thread_pool_reactor_free(pool);
+    thread_pool_counters_free(pool);
+    if (pool->schedule)
+        free(pool->schedule->log);
+    free(pool->schedule);
     sem_destroy(&pool->active_thread_counter);
-    free(pool->threads);
+    free(pool->workers);
+    _mutex_destroy(&pool->spawn_lock, &pool->spawn_lock_attr);
     blocking_deque_destroy(&pool->tasks);
 }
 
@@ -141,13 +228,56 @@ static void* handler_thread(__attribute__((unused)) void* arg) {
 }
 
 
+// The inbox goes first, but a steady stream of tasks deferred to the worker
+// does not keep it from the shared queue for more than INBOX_BATCH tasks.
+static int worker_try_pop(worker_t *worker, runnable_t *runnable) {
+    int err;
+    if (worker->inbox_streak < INBOX_BATCH
+            && (err = inbox_pop(&worker->inbox, runnable)) != DEQUE_EMPTY) {
+        worker->inbox_streak++;
+        return err;
+    }
+    worker->inbox_streak = 0;
+    if ((err = blocking_deque_try_pop_front(&worker->pool->tasks, runnable)) != DEQUE_EMPTY)
+        return err;
+    return inbox_pop(&worker->inbox, runnable);
+}
+
+// Worker sleeps on its own semaphore after announcing itself as idle;
+// whoever adds a task wakes one idle worker (see thread_pool_wake_worker),
+// or the addressed worker for tasks in its inbox.
+static int worker_next_task(worker_t *worker, runnable_t *runnable) {
+    int err;
+
+    while (1) {
+        if ((err = worker_try_pop(worker, runnable)) != DEQUE_EMPTY)
+            return err;
+        __atomic_store_n(&worker->idle, 1, __ATOMIC_SEQ_CST);
+        if ((err = worker_try_pop(worker, runnable)) != DEQUE_EMPTY) {
+            if (!__atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST)) {
+                // a wake up is already on its way, do not leave it pending
+                while (sem_wait(&worker->wake) == -1 && errno == EINTR);
+            }
+            return err;
+        }
+        while (sem_wait(&worker->wake) == -1 && errno == EINTR);
+    }
+}
+
 static void* thread_worker(void* p) {
-    thread_pool_t* pool = p;
-    blocking_deque_t * tasks = &pool->tasks;
+    worker_t* worker = p;
+    thread_pool_t* pool = worker->pool;
     runnable_t runnable;
+    current_worker = worker;
+    worker->stack_top = __builtin_frame_address(0);
+
+    sigset_t watchdog_signal;
+    FE(sigemptyset(&watchdog_signal));
+    FE(sigaddset(&watchdog_signal, WATCHDOG_SIGNAL));
+    FE(pthread_sigmask(SIG_UNBLOCK, &watchdog_signal, NULL));
 
     while (1) {
-        int err = blocking_deque_pop_front(tasks, &runnable);
+        int err = worker_next_task(worker, &runnable);
         if (err) {
             sem_wait(&pool->active_thread_counter);
             return NULL;
@@ -156,42 +286,111 @@ static void* thread_worker(void* p) {
             sem_wait(&pool->active_thread_counter);
             return NULL;
         }
+        __atomic_store_n(&worker->task_function, (void *)runnable.function, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&worker->task_seq, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&pool->watchdog, __ATOMIC_RELAXED))
+            __atomic_store_n(&worker->task_started_ns, watchdog_clock(), __ATOMIC_RELEASE);
+
+        worker->task_named = 0;
+        worker->task_counted = __atomic_load_n(&pool->counters, __ATOMIC_RELAXED)
+                               && thread_pool_counters_begin(pool, worker);
+
         runnable.function(runnable.arg, runnable.argsz);
+
+        if (worker->task_counted)
+            thread_pool_counters_end(pool, worker, worker->task_function);
+        __atomic_store_n(&worker->task_started_ns, 0, __ATOMIC_RELEASE);
+        worker_arena_reset(worker);
     }
 }
 
-static int create_threads(thread_pool_t * pool) {
-    size_t i;
-    for (i = 0; i < pool->pool_size; ++i) {
-        if (pthread_create(&pool->threads[i], NULL, thread_worker, pool)) {
-            goto CLEANUP;
-        }
+static int create_worker(thread_pool_t * pool, size_t id) {
+    worker_t *worker = &pool->workers[id];
+    worker->pool = pool;
+    worker->id = id;
+    worker->idle = 0;
+    worker->inbox_streak = 0;
+    worker->arena = NULL;
+    if (sem_init(&worker->wake, 0, 0))
+        return ERR;
+    inbox_init(&worker->inbox);
+    FE(pthread_once(&handler_once, set_handlers));
+
+    // workers leave the signals to the handler thread
+    sigset_t blocked, old;
+    handled_signals(&blocked);
+    FE(pthread_sigmask(SIG_BLOCK, &blocked, &old));
+    int err = pthread_create(&worker->thread, NULL, thread_worker, worker);
+    FE(pthread_sigmask(SIG_SETMASK, &old, NULL));
+    if (err) {
+        sem_destroy(&worker->wake);
+        inbox_destroy(&worker->inbox);
+        return ERR;
     }
     return OK;
+}
 
-CLEANUP:
-    while (i--) {
-        assert(pthread_cancel(pool->threads[i]) == 0);
+// Fails only if the pool is left without any worker to run its tasks.
+static int thread_pool_spawn_worker(thread_pool_t *pool) {
+    int err = OK;
+    // once the pool is full, tasks which find no idle worker skip the lock
+    if (__atomic_load_n(&pool->spawned, __ATOMIC_ACQUIRE) >= pool->pool_size
+            || !__atomic_load_n(&pool->allow_adding, __ATOMIC_ACQUIRE))
+        return OK;
+    FE(robust_mutex_lock(&pool->spawn_lock));
+    size_t spawned = pool->spawned;
+    if (pool->allow_adding && spawned < pool->pool_size) {
+        if (create_worker(pool, spawned) == OK)
+            __atomic_store_n(&pool->spawned, spawned + 1, __ATOMIC_RELEASE);
+        else if (spawned == 0)
+            err = ERR;
     }
-    return ERR;
+    pthread_mutex_unlock(&pool->spawn_lock);
+    return err;
+}
+
+static int thread_pool_wake_worker(thread_pool_t *pool) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    size_t spawned = __atomic_load_n(&pool->spawned, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < spawned; ++i) {
+        worker_t *worker = &pool->workers[i];
+        if (__atomic_load_n(&worker->idle, __ATOMIC_SEQ_CST)
+                && __atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST))
+            return sem_post(&worker->wake);
+    }
+    return thread_pool_spawn_worker(pool);
+}
+
+static int thread_pool_wake_given_worker(worker_t *worker) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->idle, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST))
+        return sem_post(&worker->wake);
+    return OK;
 }
 
 int thread_pool_init(thread_pool_t *pool, size_t num_threads) {
+    FE(pthread_once(&active_pools_once, init_active_pools));
     pool->allow_adding = 1;
     pool->deleted = 0;
     pool->pool_size = num_threads;
+    pool->spawned = 0;
+    pool->watchdog = NULL;
+    pool->reactor = NULL;
+    pool->counters = NULL;
+    pool->schedule = NULL;
     if (blocking_deque_init(&pool->tasks))
         goto DESTROY_NOTHING;
 
-    pool->threads = calloc(num_threads, sizeof(*pool->threads));
-    if (pool->threads == NULL)
+    pool->workers = calloc(num_threads, sizeof(*pool->workers));
+    if (pool->workers == NULL && num_threads > 0)
         goto DESTROY_DEQUE;
 
-    if (sem_init(&pool->active_thread_counter, 0, num_threads))
-        goto DESTROY_THREAD_ARRAY;
+    if (_mutex_init(&pool->spawn_lock, &pool->spawn_lock_attr))
+        goto DESTROY_WORKER_ARRAY;
 
-    if (create_threads(pool))
-        goto DESTROY_ACTIVE_THREAD_COUNTER;
+    if (sem_init(&pool->active_thread_counter, 0, num_threads))
+        goto DESTROY_SPAWN_LOCK;
 
     if (struct_vector_push_back(&active_pools, pool))
         goto DESTROY_ACTIVE_THREAD_COUNTER;
@@ -200,15 +399,49 @@ int thread_pool_init(thread_pool_t *pool, size_t num_threads) {
 
 DESTROY_ACTIVE_THREAD_COUNTER:
     sem_destroy(&pool->active_thread_counter);
-DESTROY_THREAD_ARRAY:
-    free(pool->threads);
+DESTROY_SPAWN_LOCK:
+    _mutex_destroy(&pool->spawn_lock, &pool->spawn_lock_attr);
+DESTROY_WORKER_ARRAY:
+    free(pool->workers);
 DESTROY_DEQUE:
     blocking_deque_destroy(&pool->tasks);
 DESTROY_NOTHING:
     return ERR;
 }
 
+void worker_mark_awaiting(int awaiting) {
+    if (current_worker)
+        __atomic_store_n(&current_worker->awaiting, awaiting, __ATOMIC_RELEASE);
+}
+
+// Called by trampolines (async, task groups, executors...) before they call
+// the user function, so that the task is reported and counted under its
+// name. A trampoline running several user functions (an executor turn) has
+// each one counted apart.
+void worker_name_task(void *function) {
+    worker_t *worker = current_worker;
+    if (worker == NULL)
+        return;
+    if (worker->task_counted && worker->task_named) {
+        thread_pool_counters_end(worker->pool, worker, worker->task_function);
+        worker->task_counted = thread_pool_counters_begin(worker->pool, worker);
+    }
+    worker->task_named = 1;
+    __atomic_store_n(&worker->task_function, function, __ATOMIC_RELAXED);
+}
+
+long thread_pool_current_worker(void) {
+    return current_worker ? (long)current_worker->id : -1;
+}
+
+thread_pool_t *thread_pool_default(void) {
+    FE(pthread_once(&default_pool_once, init_default_pool));
+    return &default_pool;
+}
+
 void thread_pool_destroy(struct thread_pool *pool) {
+    // as workers would, finish what was deferred
+    thread_pool_run_until_idle(pool);
     FE(robust_mutex_lock(&active_pools.lock));
     thread_pool_halt_threads(pool);
     thread_pool_decomission_resources(pool);
@@ -216,20 +449,203 @@ void thread_pool_destroy(struct thread_pool *pool) {
     struct_vector_remove(&active_pools, pool);
 }
 
+// splitmix64 finalizer
+static unsigned long long mix64(unsigned long long h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// Called with the queue locked.
+static int schedule_record(struct schedule *schedule, runnable_t *runnable, size_t worker) {
+    if (schedule->length == schedule->capacity) {
+        size_t capacity = schedule->capacity ? 2 * schedule->capacity : 64;
+        schedule_entry_t *log = realloc(schedule->log, capacity * sizeof(*log));
+        if (log == NULL)
+            return ERR;
+        schedule->log = log;
+        schedule->capacity = capacity;
+    }
+    schedule->log[schedule->length++] =
+        (schedule_entry_t){.function = runnable->function, .arg = runnable->arg,
+                           .worker = worker};
+    return OK;
+}
+
 int defer(struct thread_pool *pool, runnable_t runnable) {
-    if (!pool->allow_adding)
+    int err;
+    if (pool == NULL)
+        pool = thread_pool_default();
+    if (!__atomic_load_n(&pool->allow_adding, __ATOMIC_ACQUIRE))
+        return ERR;
+    if ((err = blocking_deque_push_back(&pool->tasks, &runnable)))
+        return err;
+    return thread_pool_wake_worker(pool);
+}
+
+int defer_to(struct thread_pool *pool, size_t worker_id, runnable_t runnable) {
+    int err;
+    if (pool == NULL)
+        pool = thread_pool_default();
+    if (worker_id >= pool->pool_size
+            || !__atomic_load_n(&pool->allow_adding, __ATOMIC_ACQUIRE))
+        return ERR;
+    size_t spawned;
+    while ((spawned = __atomic_load_n(&pool->spawned, __ATOMIC_ACQUIRE)) <= worker_id) {
+        if ((err = thread_pool_spawn_worker(pool)))
+            return err;
+        if (__atomic_load_n(&pool->spawned, __ATOMIC_ACQUIRE) == spawned)
+            return ERR;
+    }
+    worker_t *worker = &pool->workers[worker_id];
+    if ((err = inbox_push(&worker->inbox, &runnable)))
+        return err;
+    return thread_pool_wake_given_worker(worker);
+}
+
+int defer_keyed(struct thread_pool *pool, size_t key, runnable_t runnable) {
+    if (pool == NULL)
+        pool = thread_pool_default();
+    if (pool->pool_size == 0)
+        return ERR;
+    // spreads consecutive keys over workers
+    return defer_to(pool, mix64(key) % pool->pool_size, runnable);
+}
+
+// Runs one queued task of a pool of size 0 on the calling thread.
+int thread_pool_run_one(thread_pool_t *pool) {
+    blocking_deque_t *d = &pool->tasks;
+    runnable_t runnable;
+    if (pool->pool_size != 0 || pool->deleted)
+        return ERR;
+    if (sem_trywait(&d->sem) == -1)
+        return errno == EAGAIN ? DEQUE_EMPTY : ERR;
+    FE(robust_mutex_lock(&d->lock));
+    struct schedule *schedule = pool->schedule;
+    size_t worker = 0;
+    if (schedule) {
+        size_t candidates = deque_size(&d->deque);
+        if (candidates > schedule->virtual_workers)
+            candidates = schedule->virtual_workers;
+        schedule->state += 0x9e3779b97f4a7c15ull;
+        worker = mix64(schedule->state) % candidates;
+    }
+    // the semaphore counted it, so it is there
+    deque_pop_nth(&d->deque, worker, &runnable);
+    // out of memory the task is left out of the log rather than not run
+    if (schedule)
+        schedule_record(schedule, &runnable, worker);
+    pthread_mutex_unlock(&d->lock);
+
+    // what the task takes from the arena is released as it would be on a
+    // worker, but not what the task awaiting it took
+    inline_depth++;
+    worker_arena_scope_t scope = worker_arena_scope_begin();
+    runnable.function(runnable.arg, runnable.argsz);
+    worker_arena_scope_end(scope);
+    inline_depth--;
+    return OK;
+}
+
+// Nobody else runs the tasks of a pool of size 0, so a thread waiting for
+// them runs them itself. Other threads (I/O completions, timers) may still
+// queue tasks while it waits, so it looks at the queue again every
+// millisecond.
+static void inline_wait_until(struct timespec *until) {
+    clock_gettime(CLOCK_REALTIME, until);
+    until->tv_nsec += 1000000;
+    if (until->tv_nsec >= 1000000000) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000;
+    }
+}
+
+// sem_wait, running the tasks of pool meanwhile if it has size 0.
+int thread_pool_sem_wait(thread_pool_t *pool, sem_t *sem) {
+    int err;
+    if (pool == NULL || pool->pool_size != 0) {
+        while ((err = sem_wait(sem)) != 0 && errno == EINTR);
+        return err;
+    }
+    while (sem_trywait(sem) != 0) {
+        if (errno != EAGAIN)
+            return ERR;
+        if (thread_pool_run_one(pool) == OK)
+            continue;
+        struct timespec until;
+        inline_wait_until(&until);
+        if (sem_timedwait(sem, &until) == 0)
+            break;
+        if (errno != ETIMEDOUT && errno != EINTR)
+            return ERR;
+    }
+    return OK;
+}
+
+// pthread_cond_wait, except that on a pool of size 0 it runs one of its
+// tasks with the mutex released, or waits a millisecond at most. Callers
+// check their condition again either way.
+int thread_pool_cond_wait(thread_pool_t *pool, pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    int err;
+    if (pool == NULL || pool->pool_size != 0)
+        return pthread_cond_wait(cond, mutex);
+    pthread_mutex_unlock(mutex);
+    int ran = thread_pool_run_one(pool) == OK;
+    if ((err = robust_mutex_lock(mutex)) || ran)
+        return err;
+    struct timespec until;
+    inline_wait_until(&until);
+    err = pthread_cond_timedwait(cond, mutex, &until);
+    return err == ETIMEDOUT ? OK : err;
+}
+
+size_t thread_pool_run_until_idle(thread_pool_t *pool) {
+    size_t ran = 0;
+    while (thread_pool_run_one(pool) == OK)
+        ran++;
+    return ran;
+}
+
+int thread_pool_schedule(thread_pool_t *pool, size_t virtual_workers,
+                         unsigned long long seed) {
+    if (pool->pool_size != 0 || virtual_workers == 0)
+        return ERR;
+    struct schedule *schedule = calloc(1, sizeof(*schedule));
+    if (schedule == NULL)
         return ERR;
-    return blocking_deque_push_back(&pool->tasks, &runnable);
+    schedule->virtual_workers = virtual_workers;
+    schedule->state = seed;
+    FE(robust_mutex_lock(&pool->tasks.lock));
+    struct schedule *old = pool->schedule;
+    pool->schedule = schedule;
+    pthread_mutex_unlock(&pool->tasks.lock);
+    if (old)
+        free(old->log);
+    free(old);
+    return OK;
+}
+
+size_t thread_pool_schedule_log(thread_pool_t *pool, schedule_entry_t *entries,
+                                size_t max) {
+    size_t length = 0;
+    FE(robust_mutex_lock(&pool->tasks.lock));
+    struct schedule *schedule = pool->schedule;
+    if (schedule) {
+        length = schedule->length;
+        memcpy(entries, schedule->log, (length < max ? length : max) * sizeof(*entries));
+    }
+    pthread_mutex_unlock(&pool->tasks.lock);
+    return length;
 }
 
-static void deque_init(deque_t *d) {
+void deque_init(deque_t *d) {
     d->size = 0;
     d->begin.prev = d->end.next = NULL;
     d->begin.next = &d->end;
     d->end.prev = &d->begin;
 }
 
-static void deque_destroy(deque_t *d) {
+void deque_destroy(deque_t *d) {
     for (node_t * ptr = d->begin.next; ptr != &d->end;) {
         node_t * next = ptr->next;
         free(ptr);
@@ -237,15 +653,15 @@ static void deque_destroy(deque_t *d) {
     }
 }
 
-static size_t deque_size(deque_t *d) {
+size_t deque_size(deque_t *d) {
     return d->size;
 }
 
-static int deque_is_empty(deque_t *d) {
+int deque_is_empty(deque_t *d) {
     return deque_size(d) == 0;
 }
 
-static int deque_push_back(deque_t *d, runnable_t * val) {
+int deque_push_back(deque_t *d, runnable_t * val) {
     node_t * new_node = malloc(sizeof(node_t));
     if (new_node == NULL) {
         return ERR;
@@ -260,7 +676,7 @@ static int deque_push_back(deque_t *d, runnable_t * val) {
     return OK;
 }
 
-static int deque_pop_front(deque_t *d, runnable_t * val) {
+int deque_pop_front(deque_t *d, runnable_t * val) {
     if (deque_is_empty(d)) {
         return DEQUE_EMPTY;
     }
@@ -276,7 +692,25 @@ static int deque_pop_front(deque_t *d, runnable_t * val) {
     return OK;
 }
 
-static int deque_pop_back(deque_t *d, runnable_t * val) {
+int deque_pop_nth(deque_t *d, size_t n, runnable_t * val) {
+    if (n >= deque_size(d)) {
+        return DEQUE_EMPTY;
+    }
+    d->size--;
+    node_t * node = d->begin.next;
+    while (n--)
+        node = node->next;
+    *val = node->val;
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    free(node);
+
+    return OK;
+}
+
+int deque_pop_back(deque_t *d, runnable_t * val) {
     if (deque_is_empty(d)) {
         return DEQUE_EMPTY;
     }
@@ -292,49 +726,139 @@ static int deque_pop_back(deque_t *d, runnable_t * val) {
     return OK;
 }
 
-static int _mutexattr_init(pthread_mutexattr_t *attr) {
-    int err;
-    if ((err = pthread_mutexattr_init(attr)))
-        return err;
-    if ((err = pthread_mutexattr_settype(attr, PTHREAD_MUTEX_ERRORCHECK))) {
-        pthread_mutexattr_destroy(attr);
-        return err;
+#define ARENA_ALIGN (__alignof__(max_align_t))
+#define ARENA_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static arena_chunk_t *arena_chunk_new(arena_chunk_t *prev, size_t size) {
+    arena_chunk_t *chunk = malloc(ARENA_HEADER + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->prev = prev;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+// Frees the chunks newer than keep.
+static size_t arena_release(arena_chunk_t **arena, arena_chunk_t *keep) {
+    size_t released = 0;
+    while (*arena != keep) {
+        arena_chunk_t *chunk = *arena;
+        *arena = chunk->prev;
+        released += chunk->size;
+        free(chunk);
     }
-    if ((err = pthread_mutexattr_setrobust(attr, PTHREAD_MUTEX_ROBUST))) {
-        pthread_mutexattr_destroy(attr);
-        return err;
+    return released;
+}
+
+// Arena of the task running on the calling thread, NULL outside of tasks.
+static arena_chunk_t **current_arena(void) {
+    if (current_worker)
+        return &current_worker->arena;
+    return inline_depth ? &inline_arena : NULL;
+}
+
+void *worker_arena_alloc(size_t size) {
+    arena_chunk_t **arena = current_arena();
+    if (arena == NULL)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    arena_chunk_t *chunk = *arena;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk ? 2 * chunk->size : WORKER_ARENA_CHUNK;
+        if (chunk_size < size)
+            chunk_size = size;
+        if ((chunk = arena_chunk_new(chunk, chunk_size)) == NULL)
+            return NULL;
+        *arena = chunk;
     }
-    return OK;
+    void *ptr = (char *)chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    return ptr;
 }
 
-int _mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
-    int err;
-    if ((err = _mutexattr_init(attr)))
-        return err;
-    if ((err = pthread_mutex_init(mutex, attr))) {
-        pthread_mutexattr_destroy(attr);
-        return err;
+worker_arena_scope_t worker_arena_scope_begin(void) {
+    worker_arena_scope_t scope = {};
+    arena_chunk_t **arena = current_arena();
+    if (arena && (scope.chunk = *arena))
+        scope.used = scope.chunk->used;
+    return scope;
+}
+
+void worker_arena_scope_end(worker_arena_scope_t scope) {
+    arena_chunk_t **arena = current_arena();
+    if (arena == NULL)
+        return;
+    arena_release(arena, scope.chunk);
+    if (scope.chunk)
+        scope.chunk->used = scope.used;
+}
+
+// Leaves a single chunk, big enough for what the task needed.
+static void worker_arena_reset(worker_t *worker) {
+    arena_chunk_t *newest = worker->arena;
+    if (newest == NULL)
+        return;
+    if (newest->prev == NULL && newest->size <= WORKER_ARENA_KEEP) {
+        newest->used = 0;
+        return;
     }
-    return OK;
+    size_t total = arena_release(&worker->arena, NULL);
+    if (total > WORKER_ARENA_KEEP)
+        total = WORKER_ARENA_CHUNK;
+    worker->arena = arena_chunk_new(NULL, total);
 }
 
-void _mutex_destroy(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
-    pthread_mutex_destroy(mutex);
-    pthread_mutexattr_destroy(attr);
+static void worker_arena_free(worker_t *worker) {
+    arena_release(&worker->arena, NULL);
 }
 
-int robust_mutex_lock(pthread_mutex_t * mutex) {
-    int err = 0;
-    switch((err = pthread_mutex_lock(mutex))) {
-      case EOWNERDEAD:
-        return pthread_mutex_consistent(mutex);
-      case 0:
-        return 0;
-      default:
-        return err;
+static void inbox_init(inbox_t *inbox) {
+    inbox->stub.next = NULL;
+    inbox->head = inbox->tail = &inbox->stub;
+    inbox->size = 0;
+}
+
+static void inbox_destroy(inbox_t *inbox) {
+    inbox_node_t *node = inbox->head;
+    while (node) {
+        inbox_node_t *next = node->next;
+        if (node != &inbox->stub)
+            free(node);
+        node = next;
     }
 }
 
+static int inbox_push(inbox_t *inbox, runnable_t *val) {
+    inbox_node_t *node = malloc(sizeof(inbox_node_t));
+    if (node == NULL)
+        return ERR;
+    node->val = *val;
+    node->next = NULL;
+    __atomic_add_fetch(&inbox->size, 1, __ATOMIC_RELAXED);
+    inbox_node_t *prev = __atomic_exchange_n(&inbox->tail, node, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    return OK;
+}
+
+// Only called by the owning worker, or by thread_pool_destroy once it is gone.
+static int inbox_pop(inbox_t *inbox, runnable_t *val) {
+    inbox_node_t *head = inbox->head;
+    inbox_node_t *next;
+    while ((next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE)) == NULL) {
+        if (__atomic_load_n(&inbox->tail, __ATOMIC_SEQ_CST) == head)
+            return DEQUE_EMPTY;
+        // a push has taken the tail but not linked its node yet
+        sched_yield();
+    }
+    *val = next->val;
+    inbox->head = next;
+    __atomic_sub_fetch(&inbox->size, 1, __ATOMIC_RELAXED);
+    if (head != &inbox->stub)
+        free(head);
+    return OK;
+}
+
 static int blocking_deque_init(blocking_deque_t *d) {
     int err;
     memset(d, 0, sizeof(blocking_deque_t));
@@ -381,11 +905,10 @@ POP:;
     return err;
 }
 
-static int blocking_deque_pop_front(blocking_deque_t *d, runnable_t * val) {
+static int blocking_deque_try_pop_front(blocking_deque_t *d, runnable_t * val) {
     int err;
-    while (sem_wait(&d->sem) == -1 && errno == EINTR);
-    if (errno)
-        return -1;
+    if (sem_trywait(&d->sem) == -1)
+        return errno == EAGAIN ? DEQUE_EMPTY : ERR;
     if ((err = robust_mutex_lock(&d->lock)))
         return err;
     assert(deque_pop_front(&d->deque, val) == 0);   // should not fail in any case
@@ -418,7 +941,7 @@ static int struct_vector_push_back(struct vector* vec, thread_pool_t* pool) {
         }
     }
     if (vec->size+1 > vec->alloc_size) {
-        thread_pool_t** p = realloc(vec->arr, 2*vec->alloc_size);
+        thread_pool_t** p = realloc(vec->arr, 2*vec->alloc_size*sizeof(*p));
         if (!p) {
             pthread_mutex_unlock(&vec->lock);
             return ERR;
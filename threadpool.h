@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 
 typedef struct runnable {
   void (*function)(void *, size_t);
@@ -32,21 +33,185 @@ typedef struct blocking_deque {
     sem_t sem;
 } blocking_deque_t;
 
+// Lock-free queue of tasks deferred to one worker: any thread pushes at the
+// tail, only the worker pops at the head. The head is an already consumed
+// node (initially stub).
+typedef struct inbox_node {
+    struct inbox_node *next;
+    runnable_t val;
+} inbox_node_t;
+
+typedef struct inbox {
+    inbox_node_t *head;
+    inbox_node_t *tail;
+    inbox_node_t stub;
+    // tasks pushed and not popped yet, for reports
+    size_t size;
+} inbox_t;
+
+// Scratch memory of a worker, handed out by bumping a pointer. Chunks
+// are chained when a request does not fit; when the task returns all but
+// one chunk, grown to their total size, are released.
+typedef struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+typedef struct worker_arena_scope {
+    arena_chunk_t *chunk;
+    size_t used;
+} worker_arena_scope_t;
+
+#define WORKER_ARENA_CHUNK (64 * 1024)
+// bigger arenas go back to WORKER_ARENA_CHUNK after the task
+#define WORKER_ARENA_KEEP (16 * 1024 * 1024)
+
+#define WATCHDOG_STACK_DEPTH (32)
+
+// tasks a worker takes from its inbox in a row before looking at the shared
+// queue
+#define INBOX_BATCH (16)
+
+struct thread_pool;
+struct watchdog;
+struct reactor;
+struct task_counters;
+struct schedule;
+
+typedef struct worker {
+    struct thread_pool *pool;
+    pthread_t thread;
+    size_t id;
+    sem_t wake;
+    int idle;
+    // tasks for this worker only, run before the shared ones
+    inbox_t inbox;
+    unsigned inbox_streak;
+    arena_chunk_t *arena;
+    // state of the running task, inspected by the watchdog; the function is
+    // the one the task was deferred with, or the one its trampoline runs
+    void *task_function;
+    unsigned long task_seq;
+    // whether the running task is measured (see counters.h), and whether
+    // its trampoline has named it yet
+    int task_counted;
+    int task_named;
+    unsigned long long task_started_ns;
+    int awaiting;
+    unsigned long reported_seq;
+    int stack_ready;
+    int stack_depth;
+    // frame of the worker loop, where captured stacks end
+    void *stack_top;
+    void *stack[WATCHDOG_STACK_DEPTH];
+} worker_t;
+
+// Workers are spawned lazily, one per task that finds no idle worker, until
+// there are pool_size of them. A pool of size 0 has no workers: its tasks
+// queue up until a thread runs them in await or thread_pool_run_until_idle,
+// or while it waits in task_group_wait, await_cached, executor_destroy or
+// the blocking calls of async_stream_t for tasks on that pool.
 typedef struct thread_pool {
     short allow_adding;
     short deleted;
     sem_t active_thread_counter;
     size_t pool_size;
-    pthread_t* threads;
+    size_t spawned;
+    pthread_mutex_t spawn_lock;
+    pthread_mutexattr_t spawn_lock_attr;
+    worker_t* workers;
     blocking_deque_t tasks;
+    struct watchdog *watchdog;
+    // started by the first async I/O call, see reactor.h
+    struct reactor *reactor;
+    // per task function statistics, see counters.h
+    struct task_counters *counters;
+    // order in which a pool of size 0 runs its tasks, see thread_pool_schedule
+    struct schedule *schedule;
 } thread_pool_t;
 
+// Task run by a pool with a schedule.
+typedef struct schedule_entry {
+    void (*function)(void *, size_t);
+    void *arg;
+    // virtual worker which ran it, i.e. its position among the candidates
+    size_t worker;
+} schedule_entry_t;
+
 int thread_pool_init(thread_pool_t *pool, size_t pool_size);
 
+// Process-wide pool with one worker per online CPU, created on first use.
+// Passing NULL as the pool to defer (and so to async or map) selects it.
+thread_pool_t *thread_pool_default(void);
+
 void thread_pool_destroy(thread_pool_t *pool);
 
 int defer(thread_pool_t *pool, runnable_t runnable);
 
+// Runs the task on worker worker_id (below pool_size) of the pool, spawning
+// the workers up to it if needed. Tasks deferred to one worker run one at
+// a time in the order they were deferred, ahead of the shared queue (but
+// after every INBOX_BATCH of them the worker takes a shared task, if any).
+// Only that worker runs them, so a task must not await a future whose
+// task it deferred to its own worker: it would wait for itself forever.
+// Tasks still queued when the pool is destroyed are run by
+// thread_pool_destroy.
+int defer_to(thread_pool_t *pool, size_t worker_id, runnable_t runnable);
+
+// Defers to the worker chosen by a hash of key, so that tasks with equal keys
+// run in order on one thread and state sharded by key needs no locking.
+int defer_keyed(thread_pool_t *pool, size_t key, runnable_t runnable);
+
+// Runs the queued tasks of a pool of size 0 on the calling thread, including
+// those they defer, until there are none. Returns how many ran, 0 for pools
+// with workers.
+size_t thread_pool_run_until_idle(thread_pool_t *pool);
+
+// Makes a pool of size 0 pick each task to run among the virtual_workers
+// oldest queued ones, as virtual_workers workers taking them from the queue
+// could, with a pseudo-random generator seeded with seed, and record the
+// tasks in the order they run. With the same seed and the same tasks the
+// order is the same, so that a schedule can be replayed.
+int thread_pool_schedule(thread_pool_t *pool, size_t virtual_workers,
+                         unsigned long long seed);
+
+// Copies up to max entries of the order recorded so far and returns how
+// many tasks it has.
+size_t thread_pool_schedule_log(thread_pool_t *pool, schedule_entry_t *entries,
+                                size_t max);
+
+// Index of the worker running the calling task, -1 outside of pool workers.
+long thread_pool_current_worker(void);
+
+// Allocates size bytes, aligned for any type, from the arena of the worker
+// running the calling task, or for a task of a pool of size 0, from one of
+// the thread running it. The memory is valid until the task returns or an
+// enclosing scope ends, and must not be freed. Returns NULL outside of
+// tasks or when out of memory.
+void *worker_arena_alloc(size_t size);
+
+// Everything allocated after worker_arena_scope_begin is released by the
+// matching worker_arena_scope_end, so that a long task can reuse its scratch
+// memory. Scopes nest.
+worker_arena_scope_t worker_arena_scope_begin(void);
+void worker_arena_scope_end(worker_arena_scope_t scope);
+
+// Reports to stderr every task which runs longer than threshold_ms, with the
+// function symbol and the stack of its worker, and pools whose every worker
+// is blocked in await. Stacks are captured by interrupting the worker with
+// WATCHDOG_SIGNAL, so blocking calls in tasks may fail with EINTR, and by
+// following frame pointers, so they stop at code built without them.
+// Link with -rdynamic to get names of non-exported functions.
+int thread_pool_watchdog_start(thread_pool_t *pool, long threshold_ms);
+
+void thread_pool_watchdog_stop(thread_pool_t *pool);
+
+// Number of stalled tasks and starvation episodes reported so far.
+size_t thread_pool_watchdog_reports(thread_pool_t *pool);
+
+#define WATCHDOG_SIGNAL (SIGRTMIN + 1)
+
 void FE(int);
 
 #endif
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "threadpool.h"
+#include "lock.h"
+
+extern __thread worker_t *current_worker;
+
+struct watchdog {
+    thread_pool_t *pool;
+    pthread_t thread;
+    sem_t stop;
+    unsigned long long threshold_ns;
+    unsigned long long starving_since;
+    short starvation_reported;
+    size_t reports;
+};
+
+static pthread_once_t capture_handler_once = PTHREAD_ONCE_INIT;
+
+unsigned long long watchdog_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void interrupted_at(ucontext_t *context, uintptr_t *pc, uintptr_t *fp) {
+#if defined(__x86_64__)
+    *pc = context->uc_mcontext.gregs[REG_RIP];
+    *fp = context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    *pc = context->uc_mcontext.pc;
+    *fp = context->uc_mcontext.regs[29];
+#else
+    (void)context;
+    *pc = *fp = 0;
+#endif
+}
+
+// Runs on the inspected worker. backtrace is not async-signal-safe (it may
+// load libgcc and take the loader lock), so the frame pointer chain is
+// followed instead, as long as it stays between the handler and the frame
+// of the worker loop. Frames of code built without frame pointers end it
+// early.
+static void capture_stack(__attribute__((unused)) int signo,
+                          __attribute__((unused)) siginfo_t *info, void *context) {
+    worker_t *worker = current_worker;
+    // a late signal, whose stack was given up on, leaves the one asked for
+    // since (and maybe being printed) alone
+    if (worker == NULL || __atomic_load_n(&worker->stack_ready, __ATOMIC_ACQUIRE))
+        return;
+    int saved_errno = errno;
+    uintptr_t pc, fp;
+    uintptr_t low = (uintptr_t)__builtin_frame_address(0);
+    uintptr_t high = (uintptr_t)worker->stack_top;
+    int depth = 0;
+    interrupted_at(context, &pc, &fp);
+    if (pc)
+        worker->stack[depth++] = (void *)pc;
+    while (depth < WATCHDOG_STACK_DEPTH && fp > low && fp <= high
+           && fp % sizeof(uintptr_t) == 0) {
+        uintptr_t *frame = (uintptr_t *)fp;
+        if (frame[1] == 0)
+            break;
+        worker->stack[depth++] = (void *)frame[1];
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    worker->stack_depth = depth;
+    __atomic_store_n(&worker->stack_ready, 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+static void set_capture_handler() {
+    struct sigaction act = {};
+    act.sa_sigaction = capture_stack;
+    act.sa_flags = SA_RESTART | SA_SIGINFO;
+    FE(sigemptyset(&act.sa_mask));
+    FE(sigaction(WATCHDOG_SIGNAL, &act, NULL));
+}
+
+static void print_worker_stack(worker_t *worker) {
+    __atomic_store_n(&worker->stack_ready, 0, __ATOMIC_RELEASE);
+    if (pthread_kill(worker->thread, WATCHDOG_SIGNAL))
+        return;
+    struct timespec pause = {0, 1000 * 1000};
+    for (int i = 0; i < 100 && !__atomic_load_n(&worker->stack_ready, __ATOMIC_ACQUIRE); ++i)
+        nanosleep(&pause, NULL);
+    if (!__atomic_load_n(&worker->stack_ready, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "worker %zu did not respond to stack capture\n", worker->id);
+        return;
+    }
+    int stderr_fileno = 2;
+    backtrace_symbols_fd(worker->stack, worker->stack_depth, stderr_fileno);
+}
+
+static void report_stalled_task(struct watchdog *watchdog, worker_t *worker,
+                                unsigned long long running_ns) {
+    void *function = __atomic_load_n(&worker->task_function, __ATOMIC_RELAXED);
+    fprintf(stderr, "\nWatchdog: task running for %llu ms on worker %zu of pool %p:\n",
+            running_ns / 1000000, worker->id, (void *)watchdog->pool);
+    int stderr_fileno = 2;
+    backtrace_symbols_fd(&function, 1, stderr_fileno);
+    fprintf(stderr, "Worker stack:\n");
+    print_worker_stack(worker);
+    __atomic_add_fetch(&watchdog->reports, 1, __ATOMIC_RELEASE);
+}
+
+static void report_starvation(struct watchdog *watchdog, size_t queued) {
+    thread_pool_t *pool = watchdog->pool;
+    fprintf(stderr, "\nWatchdog: all %zu workers of pool %p are blocked in await, "
+            "%zu tasks queued\n", pool->spawned, (void *)pool, queued);
+    for (size_t i = 0; i < pool->spawned; ++i) {
+        fprintf(stderr, "Worker %zu stack:\n", i);
+        print_worker_stack(&pool->workers[i]);
+    }
+    __atomic_add_fetch(&watchdog->reports, 1, __ATOMIC_RELEASE);
+}
+
+static void inspect_pool(struct watchdog *watchdog) {
+    thread_pool_t *pool = watchdog->pool;
+    unsigned long long now = watchdog_clock();
+    size_t spawned = __atomic_load_n(&pool->spawned, __ATOMIC_ACQUIRE);
+    size_t awaiting = 0;
+
+    for (size_t i = 0; i < spawned; ++i) {
+        worker_t *worker = &pool->workers[i];
+        unsigned long seq = __atomic_load_n(&worker->task_seq, __ATOMIC_RELAXED);
+        unsigned long long started = __atomic_load_n(&worker->task_started_ns, __ATOMIC_ACQUIRE);
+        if (started && started < now && now - started > watchdog->threshold_ns
+                && seq != worker->reported_seq) {
+            worker->reported_seq = seq;
+            report_stalled_task(watchdog, worker, now - started);
+        }
+        awaiting += __atomic_load_n(&worker->awaiting, __ATOMIC_ACQUIRE);
+    }
+
+    if (spawned == 0 || spawned < pool->pool_size || awaiting < spawned) {
+        watchdog->starving_since = 0;
+        watchdog->starvation_reported = 0;
+    } else if (watchdog->starving_since == 0) {
+        watchdog->starving_since = now;
+    } else if (!watchdog->starvation_reported
+               && now - watchdog->starving_since > watchdog->threshold_ns) {
+        watchdog->starvation_reported = 1;
+        FE(robust_mutex_lock(&pool->tasks.lock));
+        size_t queued = pool->tasks.deque.size;
+        pthread_mutex_unlock(&pool->tasks.lock);
+        // and those deferred to a given worker
+        for (size_t i = 0; i < spawned; ++i)
+            queued += __atomic_load_n(&pool->workers[i].inbox.size, __ATOMIC_RELAXED);
+        report_starvation(watchdog, queued);
+    }
+}
+
+static void* watchdog_thread(void *arg) {
+    struct watchdog *watchdog = arg;
+    unsigned long long period = watchdog->threshold_ns / 2;
+
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += period / 1000000000;
+        deadline.tv_nsec += period % 1000000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (sem_timedwait(&watchdog->stop, &deadline) == 0)
+            return NULL;
+        if (errno != ETIMEDOUT && errno != EINTR)
+            FE(errno);
+        inspect_pool(watchdog);
+    }
+}
+
+int thread_pool_watchdog_start(thread_pool_t *pool, long threshold_ms) {
+    if (threshold_ms <= 0 || pool->watchdog != NULL)
+        return ERR;
+    FE(pthread_once(&capture_handler_once, set_capture_handler));
+
+    struct watchdog *watchdog = calloc(1, sizeof(*watchdog));
+    if (watchdog == NULL)
+        return ERR;
+    watchdog->pool = pool;
+    watchdog->threshold_ns = threshold_ms * 1000000ull;
+    if (sem_init(&watchdog->stop, 0, 0))
+        goto FREE;
+
+    sigset_t blocked, old;
+    FE(sigfillset(&blocked));
+    FE(pthread_sigmask(SIG_SETMASK, &blocked, &old));
+    int err = pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog);
+    FE(pthread_sigmask(SIG_SETMASK, &old, NULL));
+    if (err)
+        goto DESTROY_SEM;
+
+    __atomic_store_n(&pool->watchdog, watchdog, __ATOMIC_RELEASE);
+    return OK;
+
+DESTROY_SEM:
+    sem_destroy(&watchdog->stop);
+FREE:
+    free(watchdog);
+    return ERR;
+}
+
+void thread_pool_watchdog_stop(thread_pool_t *pool) {
+    struct watchdog *watchdog = pool->watchdog;
+    if (watchdog == NULL)
+        return;
+    __atomic_store_n(&pool->watchdog, NULL, __ATOMIC_RELEASE);
+    FE(sem_post(&watchdog->stop));
+    FE(pthread_join(watchdog->thread, NULL));
+    sem_destroy(&watchdog->stop);
+    free(watchdog);
+}
+
+size_t thread_pool_watchdog_reports(thread_pool_t *pool) {
+    struct watchdog *watchdog = pool->watchdog;
+    return watchdog ? __atomic_load_n(&watchdog->reports, __ATOMIC_ACQUIRE) : 0;
+}
@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "future.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static int released;
+
+// Spins rather than sleeps, so that it is interrupted in its own code.
+void *stall(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+            size_t *retsz __attribute__((unused))) {
+  while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE));
+  return NULL;
+}
+
+static int captured, saved_stderr;
+
+// Sends stderr to a file until capture_end, which returns what was printed.
+static void capture_begin() {
+  char path[] = "/tmp/watchdog_reportXXXXXX";
+  captured = mkstemp(path);
+  unlink(path);
+  saved_stderr = dup(2);
+  fflush(stderr);
+  dup2(captured, 2);
+}
+
+static char *capture_end() {
+  fflush(stderr);
+  dup2(saved_stderr, 2);
+  close(saved_stderr);
+  off_t size = lseek(captured, 0, SEEK_END);
+  char *report = calloc(size + 1, 1);
+  pread(captured, report, size, 0);
+  close(captured);
+  return report;
+}
+
+// Runs the stalled task with stderr going to a file and returns what was
+// printed.
+static char *stalled_report(thread_pool_t *pool, size_t *reports) {
+  capture_begin();
+  future_t future;
+  released = 0;
+  async(pool, &future, (callable_t){.function = stall});
+  for (int i = 0; i < 500 && thread_pool_watchdog_reports(pool) == 0; ++i)
+    usleep(2000);
+  __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+  await(&future);
+  *reports = thread_pool_watchdog_reports(pool);
+  return capture_end();
+}
+
+#ifndef __SANITIZE_THREAD__
+// Whether one of the addresses backtrace_symbols_fd printed after from
+// lies within size bytes of code.
+static int has_address(char *from, void *code, size_t size) {
+  for (char *at = strstr(from, "[0x"); at; at = strstr(at + 1, "[0x")) {
+    uintptr_t address = strtoull(at + 1, NULL, 16);
+    if (address >= (uintptr_t)code && address < (uintptr_t)code + size)
+      return 1;
+  }
+  return 0;
+}
+#endif
+
+static char *test_stalled_task_reported() {
+  thread_pool_t pool;
+  size_t reports;
+  thread_pool_init(&pool, 1);
+  mu_assert("watchdog not started", thread_pool_watchdog_start(&pool, 20) == 0);
+  char *report = stalled_report(&pool, &reports);
+  thread_pool_watchdog_stop(&pool);
+  thread_pool_destroy(&pool);
+
+  mu_assert("no report", reports == 1);
+  char *header = strstr(report, "Watchdog: task running for");
+  mu_assert("report without header", header != NULL);
+  char function[32];
+  snprintf(function, sizeof(function), "[%p]", (void *)stall);
+  char *stack = strstr(header, "Worker stack:");
+  mu_assert("report without stack", stack != NULL);
+  char *named = strstr(header, function);
+  mu_assert("reported under the trampoline", named != NULL && named < stack);
+#ifndef __SANITIZE_THREAD__
+  // ThreadSanitizer holds signals back until the next intercepted call
+  mu_assert("stack not captured", has_address(stack, (void *)stall, 128));
+#endif
+  free(report);
+  return 0;
+}
+
+static thread_pool_t other;
+static int waiting;
+
+static void gate(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE))
+    usleep(1000);
+}
+
+static void *pass(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                  size_t *retsz __attribute__((unused))) {
+  return NULL;
+}
+
+// Awaits a task held up on the other pool.
+static void *wait_other(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                        size_t *retsz __attribute__((unused))) {
+  future_t future;
+  async(&other, &future, (callable_t){.function = pass});
+  __atomic_store_n(&waiting, 1, __ATOMIC_RELEASE);
+  await(&future);
+  return NULL;
+}
+
+static void noop(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {}
+
+static size_t count(const char *text, const char *what) {
+  size_t found = 0;
+  for (const char *at = strstr(text, what); at; at = strstr(at + 1, what))
+    found++;
+  return found;
+}
+
+static char *test_starvation_reported() {
+  thread_pool_t pool;
+  future_t future;
+  thread_pool_init(&pool, 1);
+  thread_pool_init(&other, 1);
+  released = 0;
+  waiting = 0;
+  defer(&other, (runnable_t){.function = gate});
+  mu_assert("watchdog not started", thread_pool_watchdog_start(&pool, 20) == 0);
+
+  capture_begin();
+  async(&pool, &future, (callable_t){.function = wait_other});
+  while (!__atomic_load_n(&waiting, __ATOMIC_ACQUIRE))
+    usleep(1000);
+  // queued behind the only worker, shared and deferred to it
+  for (int i = 0; i < 2; ++i)
+    defer(&pool, (runnable_t){.function = noop});
+  for (int i = 0; i < 3; ++i)
+    defer_to(&pool, 0, (runnable_t){.function = noop});
+  // the awaiting task is reported as stalled too
+  for (int i = 0; i < 500 && thread_pool_watchdog_reports(&pool) < 2; ++i)
+    usleep(2000);
+  // the starvation lasts on, it is still reported once
+  usleep(100000);
+  __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+  await(&future);
+  thread_pool_watchdog_stop(&pool);
+  char *report = capture_end();
+  thread_pool_destroy(&pool);
+  thread_pool_destroy(&other);
+
+  mu_assert("starvation not reported once", count(report, "are blocked in await") == 1);
+  mu_assert("inbox tasks not counted", strstr(report, "5 tasks queued") != NULL);
+  free(report);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_stalled_task_reported);
+  mu_run_test(test_starvation_reported);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
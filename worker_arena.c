@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "threadpool.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+typedef struct {
+  long worker;
+  void *first;
+  void *big;
+  int aligned;
+  int scope_reused;
+  sem_t done;
+} arena_report;
+
+static void use_arena(void *arg, size_t argsz __attribute__((unused))) {
+  arena_report *report = arg;
+  report->worker = thread_pool_current_worker();
+  report->first = worker_arena_alloc(24);
+  char *odd = worker_arena_alloc(3);
+  double *next = worker_arena_alloc(sizeof(double));
+  report->aligned = (uintptr_t)report->first % 16 == 0 && (uintptr_t)odd % 16 == 0
+                    && (uintptr_t)next % 16 == 0 && odd != (char *)next;
+
+  worker_arena_scope_t scope = worker_arena_scope_begin();
+  void *inner = worker_arena_alloc(100);
+  worker_arena_scope_end(scope);
+  report->scope_reused = worker_arena_alloc(100) == inner;
+
+  // more than a chunk, makes the arena chain another one the first time
+  report->big = worker_arena_alloc(3 * WORKER_ARENA_CHUNK);
+  memset(report->big, 1, 3 * WORKER_ARENA_CHUNK);
+  sem_post(&report->done);
+}
+
+static char *test_arena_in_tasks() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  mu_assert("worker index outside of the pool", thread_pool_current_worker() == -1);
+  mu_assert("arena outside of the pool", worker_arena_alloc(8) == NULL);
+
+  arena_report reports[3] = {};
+  for (int i = 0; i < 3; ++i) {
+    sem_init(&reports[i].done, 0, 0);
+    defer_to(&pool, 1, (runnable_t){.function = use_arena, .arg = &reports[i]});
+    sem_wait(&reports[i].done);
+    sem_destroy(&reports[i].done);
+    mu_assert("wrong worker index", reports[i].worker == 1);
+    mu_assert("misaligned allocation", reports[i].aligned);
+    mu_assert("scope end did not release", reports[i].scope_reused);
+  }
+  // after the first task the arena is a single chunk large enough for all
+  mu_assert("arena not reset between tasks", reports[2].first == reports[1].first);
+  mu_assert("grown arena not kept",
+            (char *)reports[1].big > (char *)reports[1].first
+            && (char *)reports[1].big - (char *)reports[1].first < WORKER_ARENA_CHUNK);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static thread_pool_t *measured_pool;
+static size_t arena_size;
+
+static void alloc_huge(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+  worker_arena_alloc(2 * WORKER_ARENA_KEEP);
+}
+
+// Runs after alloc_huge on the same worker, so the arena was reset by then.
+static void measure_arena(void *arg, size_t argsz __attribute__((unused))) {
+  arena_chunk_t *arena = measured_pool->workers[0].arena;
+  arena_size = arena ? arena->size : 0;
+  sem_post(arg);
+}
+
+static char *test_huge_arena_shrunk() {
+  thread_pool_t pool;
+  sem_t done;
+  thread_pool_init(&pool, 1);
+  sem_init(&done, 0, 0);
+  measured_pool = &pool;
+  // the first allocation of the worker, so the arena is a single chunk
+  defer_to(&pool, 0, (runnable_t){.function = alloc_huge});
+  defer_to(&pool, 0, (runnable_t){.function = measure_arena, .arg = &done});
+  sem_wait(&done);
+  mu_assert("huge arena kept after the task", arena_size <= WORKER_ARENA_CHUNK);
+  sem_destroy(&done);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_arena_in_tasks);
+  mu_run_test(test_huge_arena_shrunk);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}